@@ -5,27 +5,93 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
 #include <sys/epoll.h>
+#include <sys/syscall.h>
 #include <stdbool.h>
 #include <syslog.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
 #include "log.h"
 #include "common.h"
 #include "cleanup.h"
 #include "event.h"
 #include "timeout.h"
-
-/* size of events array in call to epoll_pwait() */
-#define MAX_EVENTS 8
+#include "histogram.h"
+#include "ts-util.h"
+#include "trace.h"
+
+/* size of events array in call to epoll_pwait(), see dispatcher_set_batch_size() */
+#define DEF_BATCH_SIZE 8
+#define MAX_BATCH_SIZE 65536
+/* adaptive batch size: shrink after this many waits using <= 1/4 of it */
+#define BATCH_IDLE_WAITS 64
 #define LEN_CHUNK 8
+/* number of TMO_CLOCK_xxx values, including TMO_CLOCK_DEFAULT */
+#define N_TMO_CLOCKS 4
+
+static const int tmo_clocks[N_TMO_CLOCKS] = {
+	[TMO_CLOCK_MONOTONIC >> 2] = CLOCK_MONOTONIC,
+	[TMO_CLOCK_BOOTTIME >> 2] = CLOCK_BOOTTIME,
+	[TMO_CLOCK_REALTIME >> 2] = CLOCK_REALTIME,
+};
 
+/*
+ * Registry slot. @gen is the generation of the event occupying the
+ * slot, it must match evt->__gen. Free slots have evt == NULL and
+ * are linked through @next_free.
+ */
+struct ev_slot {
+	struct event *evt;
+	unsigned int gen;
+	unsigned int next_free;
+};
+
+/*
+ * @len: allocated slots
+ * @n: slots in use or on the free list (slots >= @n are unused)
+ * @free: number of slots on the free list, @free_head is valid if @free > 0
+ * @pending: events whose callback returned EVENTCB_REMOVE or EVENTCB_CLEANUP,
+ *           linked through evt->__next_pending
+ * @timeout_event: timeout handler for the dispatcher's clock source
+ * @clock_tmo: timeout handlers for other clocks, indexed by TMO_CLOCK_xxx,
+ *             created when an event first uses the respective clock
+ * @tmo_events: all timeout handlers, @timeout_event first
+ * @ep_events: buffer for epoll_pwait(), @batch_size elements
+ * @batch_min, @batch_max: limits for @batch_size, see dispatcher_set_batch_size()
+ * @batch_last: number of events received by the last epoll_pwait()
+ * @batch_idle: number of waits since @batch_size was last found too small
+ * @stats: the counters of struct dispatcher_stats, see dispatcher_get_stats()
+ * @hist: latency histograms indexed by DSP_HIST_xxx, NULL if disabled
+ * @wake_ns: the time epoll_pwait() returned, if @hist or @stall_ns is set
+ * @stall_ns, @stall_hook, @stall_arg: the watchdog, see dispatcher_set_watchdog()
+ */
 struct dispatcher {
 	int epoll_fd;
 	bool exiting;
+	/* DSP_NO_TIMERFD */
+	bool inline_timeouts;
+	unsigned int flags;
+	struct timespec slack;
 	struct event *timeout_event;
+	struct event *clock_tmo[N_TMO_CLOCKS];
+	unsigned int n_tmo_events;
+	struct event *tmo_events[N_TMO_CLOCKS];
 	unsigned int len, n, free;
-	struct event **events;
+	unsigned int free_head;
+	unsigned int gen;
+	struct ev_slot *events;
+	struct event *pending;
+	struct epoll_event *ep_events;
+	unsigned int batch_size, batch_min, batch_max;
+	unsigned int batch_last, batch_idle;
+	struct dispatcher_stats stats;
+	struct histogram *hist;
+	uint64_t wake_ns;
+	uint64_t stall_ns;
+	stall_fn stall_hook;
+	void *stall_arg;
 };
 
 const char * const reason_str[__MAX_CALLBACK_REASON] = {
@@ -33,30 +99,73 @@ const char * const reason_str[__MAX_CALLBACK_REASON] = {
 	[REASON_TIMEOUT] = "timeout",
 };
 
-static int _dispatcher_increase(struct dispatcher *dsp)
+static int _dispatcher_resize(struct dispatcher *dsp, unsigned int len)
 {
-	struct event **new;
+	struct ev_slot *new;
 
-	if (dsp->len >= UINT_MAX - LEN_CHUNK)
-		return -EOVERFLOW;
-	new = realloc(dsp->events, (dsp->len + LEN_CHUNK) * sizeof(*new));
+	new = realloc(dsp->events, len * sizeof(*new));
 	if (!new)
 		return -ENOMEM;
-	dsp->len += LEN_CHUNK;
+	dsp->len = len;
 	dsp->events = new;
-	msg(LOG_DEBUG, "new size: %u\n", dsp->len);
+	msg(LOG_DEBUG, "new size: %u/%u\n", dsp->n, dsp->len);
 	return 0;
 }
 
+static int _dispatcher_increase(struct dispatcher *dsp)
+{
+	if (dsp->len == 0)
+		return _dispatcher_resize(dsp, LEN_CHUNK);
+	if (dsp->len > UINT_MAX / 2)
+		return -EOVERFLOW;
+	return _dispatcher_resize(dsp, 2 * dsp->len);
+}
+
+/*
+ * Make room for @n more events, growing the array at most once.
+ */
+static int _dispatcher_reserve(struct dispatcher *dsp, unsigned int n)
+{
+	unsigned int len;
+
+	if (n <= dsp->free + (dsp->len - dsp->n))
+		return 0;
+	n -= dsp->free;
+	if (n > UINT_MAX - dsp->n)
+		return -EOVERFLOW;
+	for (len = dsp->len ? dsp->len : LEN_CHUNK; len < dsp->n + n; len *= 2)
+		if (len > UINT_MAX / 2) {
+			len = dsp->n + n;
+			break;
+		}
+	return _dispatcher_resize(dsp, len);
+}
+
+/*
+ * Look up the registry slot of @evt using the handle stored in the event.
+ * The generation check catches stale handles, e.g. of events that
+ * have been removed in the meantime.
+ */
 static unsigned int _dispatcher_find(const struct dispatcher *dsp,
 				     const struct event *evt)
 {
-	unsigned int i;
+	unsigned int i = evt->__slot;
 
-	for (i = 0; i < dsp->n; i++)
-		if (dsp->events[i] == evt)
-			return i;
-	return UINT_MAX;
+	if (evt->__gen == 0 || i >= dsp->n ||
+	    dsp->events[i].evt != evt || dsp->events[i].gen != evt->__gen)
+		return UINT_MAX;
+	return i;
+}
+
+static void _dispatcher_set(struct dispatcher *dsp, unsigned int i,
+			    struct event *evt)
+{
+	if (++dsp->gen == 0)
+		dsp->gen++;
+	dsp->events[i].evt = evt;
+	dsp->events[i].gen = dsp->gen;
+	evt->__slot = i;
+	evt->__gen = dsp->gen;
 }
 
 static int _dispatcher_add(struct dispatcher *dsp, struct event *evt)
@@ -68,86 +177,55 @@ static int _dispatcher_add(struct dispatcher *dsp, struct event *evt)
 		return -EEXIST;
 
 	if (dsp->free > 0) {
-		for (i = 0; i < dsp->n; i++) {
-			if (dsp->events[i] == NULL)
-				break;
-		}
-		if (i == dsp->n) {
-			msg(LOG_WARNING, "free=%u, but no empty slot found\n",
-			    dsp->free);
-			dsp->free = 0;
-		} else {
-			dsp->events[i] = evt;
-			dsp->free--;
-			msg(LOG_DEBUG, "new event @%u, %u/%u/%u free\n",
-			    i, dsp->free, dsp->n, dsp->len);
-			return 0;
-		}
-	}
-
-	if (dsp->len == dsp->n)
-		if ((rc = _dispatcher_increase(dsp)) < 0)
+		i = dsp->free_head;
+		dsp->free_head = dsp->events[i].next_free;
+		dsp->free--;
+	} else {
+		if (dsp->len == dsp->n &&
+		    (rc = _dispatcher_increase(dsp)) < 0)
 			return rc;
+		i = dsp->n++;
+	}
 
-	dsp->events[dsp->n] = evt;
-	dsp->n++;
+	_dispatcher_set(dsp, i, evt);
 	msg(LOG_DEBUG, "new event @%u, %u/%u/%u free\n",
-	    dsp->n - 1, dsp->free, dsp->n, dsp->len);
+	    i, dsp->free, dsp->n, dsp->len);
 	return 0;
 }
 
+/*
+ * Shrink the slot array if less than 1/4 of it is in use. The array is
+ * only grown again when it's full, thus a shrunk array can take at least
+ * twice as many events as it holds now. This avoids realloc() thrashing if the
+ * number of events oscillates.
+ * Compaction moves events from the top of the array into free slots
+ * below, and updates their handles. It costs O(n), but happens only
+ * after at least len/4 removals.
+ */
 static int _dispatcher_gc(struct dispatcher *dsp) {
-	unsigned int i, n;
-        struct event **new;
+	unsigned int lo, hi, len, used = dsp->n - dsp->free;
 
-	if (dsp->free <= dsp->len / 4)
+	if (dsp->len <= 2 * LEN_CHUNK || used > dsp->len / 4)
 		return 0;
 
-	n = dsp->n;
-	for (i = n; i > 0; i--) {
-		unsigned int j;
-
-		if (dsp->events[i - 1] != NULL)
+	for (lo = 0, hi = dsp->n; lo < used; lo++) {
+		if (dsp->events[lo].evt != NULL)
 			continue;
-
-		for (j = i - 1; j > 0; j--)
-			if (dsp->events[j - 1] != NULL)
-				break;
-
-		memmove(&dsp->events[j], &dsp->events[i],
-			(dsp->n - i) * sizeof(*dsp->events));
-
-		n -= (i - j);
-		if (j == 0)
-			break;
-		else
-			i = j;
-	}
-
-	if (dsp->n - n  != dsp->free)
-		msg(LOG_ERR, "error: %u != %u\n", dsp->free, dsp->n - n);
-	else {
-		msg(LOG_DEBUG, "collected %u slots\n", dsp->free);
-		dsp->n = n;
-		dsp->free = 0;
-	}
-
-	for (i = 0; i < dsp->n; i++) {
-		if (dsp->events[i] == NULL)
-			msg(LOG_ERR, "error at %u\n", i);
+		do
+			hi--;
+		while (dsp->events[hi].evt == NULL);
+		dsp->events[lo] = dsp->events[hi];
+		dsp->events[lo].evt->__slot = lo;
 	}
 
-	if (dsp->len <= 2 * LEN_CHUNK || dsp->n >= dsp->len / 2)
-		return 0;
-
-	new = realloc(dsp->events, (dsp->len / 2) * sizeof(*new));
-	if (!new)
-		return -ENOMEM;
-	dsp->events = new;
-	dsp->len = dsp->len / 2;
+	msg(LOG_DEBUG, "collected %u slots\n", dsp->n - used);
+	dsp->n = used;
+	dsp->free = 0;
 
-	msg(LOG_NOTICE, "new size: %u/%u\n", dsp->n, dsp->len);
-	return 0;
+	/* After event_remove_many(), more than one halving may be due */
+	for (len = dsp->len / 2; len > 2 * LEN_CHUNK && used <= len / 4; )
+		len /= 2;
+	return _dispatcher_resize(dsp, len);
 }
 
 static int _dispatcher_remove(struct dispatcher *dsp, struct event *ev,
@@ -160,11 +238,16 @@ static int _dispatcher_remove(struct dispatcher *dsp, struct event *ev,
 		return -ENOENT;
 	}
 
-	dsp->events[i] = NULL;
+	dsp->events[i].evt = NULL;
+	dsp->events[i].gen = 0;
+	ev->__gen = 0;
 	if (i == dsp->n - 1)
 		dsp->n--;
-	else
+	else {
+		dsp->events[i].next_free = dsp->free_head;
+		dsp->free_head = i;
 		dsp->free++;
+	}
 
 	msg(LOG_DEBUG, "removed event @%u, %u/%u/%u free\n",
 	    i, dsp->free, dsp->n, dsp->len);
@@ -189,7 +272,7 @@ static void _run_cleanup_handlers(struct dispatcher *dsp, bool do_epoll)
 	unsigned int i;
 
 	for (i = 0; i < dsp->n; i++) {
-		struct event *evt = dsp->events[i];
+		struct event *evt = dsp->events[i].evt;
 
 		if (!evt)
 			continue;
@@ -203,6 +286,7 @@ static void _run_cleanup_handlers(struct dispatcher *dsp, bool do_epoll)
 
 int cleanup_dispatcher(struct dispatcher *dsp)
 {
+	unsigned int i;
 
 	if (!dsp)
 		return -EINVAL;
@@ -212,9 +296,11 @@ int cleanup_dispatcher(struct dispatcher *dsp)
 	dsp->exiting = true;
 
 	_run_cleanup_handlers(dsp, true);
-	timeout_reset(dsp->timeout_event);
+	for (i = 0; i < dsp->n_tmo_events; i++)
+		timeout_reset(dsp->tmo_events[i]);
 
 	dsp->len = dsp->n = dsp->free = 0;
+	dsp->pending = NULL;
 	free(dsp->events);
 	dsp->events = NULL;
 	dsp->exiting = false;
@@ -232,10 +318,12 @@ void free_dispatcher(struct dispatcher *dsp)
 	 * Just close the dup'd timerfd and epoll_fd, and free memory.
 	 */
 	_run_cleanup_handlers(dsp, false);
-	if (dsp->timeout_event)
-		free_timeout_event(dsp->timeout_event);
+	while (dsp->n_tmo_events > 0)
+		free_timeout_event(dsp->tmo_events[--dsp->n_tmo_events]);
 	if (dsp->epoll_fd != -1)
 		close(dsp->epoll_fd);
+	free(dsp->ep_events);
+	free(dsp->hist);
 	free(dsp->events);
 	free(dsp);
 }
@@ -243,7 +331,7 @@ void free_dispatcher(struct dispatcher *dsp)
 static DEFINE_CLEANUP_FUNC(free_dsp_p, struct dispatcher *, free_dispatcher);
 static int _event_add(struct dispatcher *dsp, struct event *evt);
 
-struct dispatcher *new_dispatcher(int clocksrc)
+struct dispatcher *new_dispatcher_ext(int clocksrc, unsigned int flags)
 {
 	struct dispatcher *dsp __cleanup__(free_dsp_p) = NULL;
 
@@ -256,10 +344,14 @@ struct dispatcher *new_dispatcher(int clocksrc)
 		return NULL;
 	}
 
-	if (!(dsp->timeout_event = new_timeout_event(clocksrc))) {
+	if (!(dsp->timeout_event = new_timeout_event_ext(clocksrc, flags))) {
 		msg(LOG_ERR, "failed to create timeout event: %m\n");
 		return NULL;
 	}
+	dsp->tmo_events[dsp->n_tmo_events++] = dsp->timeout_event;
+	dsp->inline_timeouts = flags & DSP_NO_TIMERFD;
+	dsp->flags = flags;
+	dsp->batch_min = dsp->batch_max = DEF_BATCH_SIZE;
 
 	/* Don't use event_add() here, timeout is tracked separately */
 	if (_event_add(dsp, dsp->timeout_event) != 0) {
@@ -269,6 +361,11 @@ struct dispatcher *new_dispatcher(int clocksrc)
 		return STEAL_PTR(dsp);
 }
 
+struct dispatcher *new_dispatcher(int clocksrc)
+{
+	return new_dispatcher_ext(clocksrc, 0);
+}
+
 int dispatcher_get_efd(const struct dispatcher *dsp)
 {
 	if (!dsp)
@@ -276,18 +373,76 @@ int dispatcher_get_efd(const struct dispatcher *dsp)
 	return dsp->epoll_fd;
 }
 
+/*
+ * Find the timeout handler for the clock of @evt. If @create is set,
+ * create it if necessary. Return NULL if it doesn't exist, or on error.
+ */
+static struct event *_dispatcher_tmo_event(struct dispatcher *dsp,
+					   const struct event *evt,
+					   bool create)
+{
+	unsigned int i = (evt->flags & TMO_CLOCK_MASK) >> 2;
+	struct event *tmo;
+
+	if (i == 0 ||
+	    tmo_clocks[i] == timeout_get_clocksource(dsp->timeout_event))
+		return dsp->timeout_event;
+	if (dsp->clock_tmo[i] || !create)
+		return dsp->clock_tmo[i];
+
+	if (!(tmo = new_timeout_event_ext(tmo_clocks[i], dsp->flags))) {
+		msg(LOG_ERR, "failed to create timeout event: %m\n");
+		return NULL;
+	}
+	if (_event_add(dsp, tmo) != 0) {
+		msg(LOG_ERR, "failed to dispatch timeout event: %m\n");
+		free_timeout_event(tmo);
+		return NULL;
+	}
+	timeout_set_slack(tmo, &dsp->slack);
+	if (dsp->hist)
+		timeout_set_histogram(tmo, &dsp->hist[DSP_HIST_LATENESS]);
+	dsp->clock_tmo[i] = tmo;
+	dsp->tmo_events[dsp->n_tmo_events++] = tmo;
+	return tmo;
+}
+
 static int _event_add(struct dispatcher *dsp, struct event *evt)
 {
+	struct event *tmo;
+	int rc;
+
+	/*
+	 * Check everything that can fail before adding the fd to epoll.
+	 * Timeout classes only exist for the dispatcher's clock.
+	 */
 	evt->ep.data.ptr = evt;
-	if (evt->fd != -1 &&
-	    epoll_ctl(dsp->epoll_fd, EPOLL_CTL_ADD, evt->fd, &evt->ep) == -1) {
+	if (evt->tmo_class &&
+	    _dispatcher_tmo_event(dsp, evt, false) != dsp->timeout_event)
+		rc = -EINVAL;
+	else if (!(tmo = _dispatcher_tmo_event(dsp, evt, true)))
+		rc = -ENOMEM;
+	else if (evt->fd != -1 &&
+		 epoll_ctl(dsp->epoll_fd, EPOLL_CTL_ADD, evt->fd, &evt->ep) == -1) {
+		rc = -errno;
 		msg(LOG_ERR, "failed to add event: %m\n");
-		_dispatcher_remove(evt->dsp, evt, true);
-		return -errno;
+	} else
+		rc = 0;
+	if (rc < 0) {
+		_dispatcher_remove(dsp, evt, true);
+		return rc;
 	}
 	evt->dsp = dsp;
 	evt->reason = 0;
-	return timeout_add(dsp->timeout_event, evt);
+	evt->flags &= ~(__EV_REMOVE | __EV_CLEANUP | __EV_TIMEOUT |
+			__EV_TMO_CLASS | __EV_TMO_DEFER);
+	if ((rc = timeout_add(tmo, evt)) < 0) {
+		/* e.g. invalid tmo_class, don't leave the event registered */
+		_event_remove_epoll(evt);
+		_dispatcher_remove(dsp, evt, true);
+		evt->dsp = NULL;
+	}
+	return rc;
 }
 
 int event_add(struct dispatcher *dsp, struct event *evt)
@@ -305,6 +460,7 @@ int event_add(struct dispatcher *dsp, struct event *evt)
 
 static int _event_remove(struct event *evt, bool do_gc)
 {
+	struct event *tmo;
 	int rc;
 
 	if (!evt || !evt->dsp)
@@ -315,21 +471,120 @@ static int _event_remove(struct event *evt, bool do_gc)
 		rc = -errno;
 
 	_dispatcher_remove(evt->dsp, evt, do_gc);
-	timeout_cancel(evt->dsp->timeout_event, evt);
+	if ((tmo = _dispatcher_tmo_event(evt->dsp, evt, false)) != NULL)
+		timeout_cancel(tmo, evt);
 	evt->dsp = NULL;
 
 	return rc;
 }
 
+static void _dispatcher_unlink_pending(struct dispatcher *dsp,
+				       struct event *evt)
+{
+	struct event **pp;
+
+	for (pp = &dsp->pending; *pp; pp = &(*pp)->__next_pending)
+		if (*pp == evt) {
+			*pp = evt->__next_pending;
+			evt->__next_pending = NULL;
+			return;
+		}
+}
+
 int event_remove(struct event *evt)
 {
+	if (evt && evt->dsp && evt->flags & (__EV_REMOVE | __EV_CLEANUP))
+		_dispatcher_unlink_pending(evt->dsp, evt);
 	return _event_remove(evt, true);
 }
 
+/*
+ * Batches of timeouts: the timers aren't re-armed, and new timeouts aren't
+ * sorted, until the batch ends. Most events use the dispatcher's clock,
+ * reserve memory for @n timeouts in its handler.
+ */
+static void _dispatcher_begin_batch(struct dispatcher *dsp, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < dsp->n_tmo_events; i++)
+		timeout_batch_begin(dsp->tmo_events[i], i == 0 ? n : 0);
+}
+
+static void _dispatcher_end_batch(struct dispatcher *dsp)
+{
+	unsigned int i;
+
+	for (i = 0; i < dsp->n_tmo_events; i++)
+		timeout_batch_end(dsp->tmo_events[i]);
+}
+
+int event_add_many(struct dispatcher *dsp, struct event * const *evts,
+		   unsigned int n)
+{
+	unsigned int i, j;
+	int rc = 0;
+
+	if (!dsp || (n > 0 && !evts))
+		return -EINVAL;
+	for (i = 0; i < n; i++)
+		if (!evts[i] || !evts[i]->callback)
+			return -EINVAL;
+	if (dsp->exiting)
+		return -EBUSY;
+	if ((rc = _dispatcher_reserve(dsp, n)) < 0)
+		return rc;
+
+	_dispatcher_begin_batch(dsp, n);
+	for (i = 0; i < n; i++) {
+		if ((rc = _dispatcher_add(dsp, evts[i])) < 0)
+			break;
+		if ((rc = _event_add(dsp, evts[i])) < 0)
+			break;
+	}
+	_dispatcher_end_batch(dsp);
+	if (rc == 0)
+		return 0;
+
+	msg(LOG_ERR, "failed to add event %u/%u: %s\n", i, n, strerror(-rc));
+	for (j = 0; j < i; j++)
+		_event_remove(evts[j], false);
+	_dispatcher_gc(dsp);
+	return rc;
+}
+
+int event_remove_many(struct dispatcher *dsp, struct event * const *evts,
+		      unsigned int n)
+{
+	unsigned int i;
+	int rc = 0, r;
+
+	if (!dsp || (n > 0 && !evts))
+		return -EINVAL;
+
+	_dispatcher_begin_batch(dsp, 0);
+	for (i = 0; i < n; i++) {
+		struct event *evt = evts[i];
+
+		if (!evt || evt->dsp != dsp) {
+			rc = -EINVAL;
+			continue;
+		}
+		if (evt->flags & (__EV_REMOVE | __EV_CLEANUP))
+			_dispatcher_unlink_pending(dsp, evt);
+		if ((r = _event_remove(evt, false)) < 0)
+			rc = r;
+	}
+	_dispatcher_end_batch(dsp);
+	_dispatcher_gc(dsp);
+	return rc;
+}
+
 int event_mod_timeout(struct event *evt, const struct timespec *tmo)
 {
 	unsigned int i;
 	struct timespec ts;
+	struct event *tmo_ev;
 
 	if (!evt || !evt->dsp || !tmo)
 		return -EINVAL;
@@ -340,8 +595,33 @@ int event_mod_timeout(struct event *evt, const struct timespec *tmo)
 		return -EEXIST;
 	}
 
+	if (!(tmo_ev = _dispatcher_tmo_event(evt->dsp, evt, true)))
+		return -ENOMEM;
 	ts = *tmo;
-	return timeout_modify(evt->dsp->timeout_event, evt, &ts);
+	return timeout_modify(tmo_ev, evt, &ts);
+}
+
+int dispatcher_add_tmo_class(struct dispatcher *dsp,
+			     const struct timespec *duration)
+{
+	if (!dsp || !duration)
+		return -EINVAL;
+	return timeout_add_class(dsp->timeout_event, duration);
+}
+
+int event_mod_tmo_class(struct event *evt, unsigned int tmo_class)
+{
+	if (!evt || !evt->dsp)
+		return -EINVAL;
+	if (evt->dsp->exiting)
+		return -EBUSY;
+	if (_dispatcher_find(evt->dsp, evt) == UINT_MAX) {
+		msg(LOG_WARNING, "attempt to modify non-existing event\n");
+		return -EEXIST;
+	}
+	if (_dispatcher_tmo_event(evt->dsp, evt, false) != evt->dsp->timeout_event)
+		return -EINVAL;
+	return timeout_modify_class(evt->dsp->timeout_event, evt, tmo_class);
 }
 
 int event_modify(struct event *evt)
@@ -362,10 +642,66 @@ int event_modify(struct event *evt)
 	return rc == -1 ? -errno : 0;
 }
 
+/*
+ * Histograms and the watchdog use CLOCK_MONOTONIC, regardless of the
+ * dispatcher's clock.
+ */
+static uint64_t _mono_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool _dispatcher_timed(const struct dispatcher *dsp)
+{
+	return dsp->hist || dsp->stall_ns;
+}
+
+static void _dispatcher_stall(struct dispatcher *dsp, const struct event *evt,
+			      cb_fn callback, int fd, uint64_t ns)
+{
+	if (evt)
+		dsp->stats.slow_callbacks++;
+	else
+		dsp->stats.loop_stalls++;
+	if (dsp->stall_hook)
+		dsp->stall_hook(evt, callback, fd, ns, dsp->stall_arg);
+	else if (evt)
+		msg(LOG_WARNING, "callback %p for fd %d took %llu us\n",
+		    (void *)callback, fd, (unsigned long long)ns / 1000);
+	else
+		msg(LOG_WARNING, "dispatching events took %llu us\n",
+		    (unsigned long long)ns / 1000);
+}
+
+/*
+ * Called after a callback that was started at @start. The callback may
+ * have disabled the histograms or the watchdog.
+ */
+static void _dispatcher_callback_done(struct dispatcher *dsp,
+				      const struct event *evt, cb_fn callback,
+				      int fd, uint64_t start)
+{
+	uint64_t ns = _mono_now() - start;
+
+	if (dsp->hist) {
+		histogram_add(&dsp->hist[DSP_HIST_DISPATCH],
+			      start > dsp->wake_ns ? start - dsp->wake_ns : 0);
+		histogram_add(&dsp->hist[DSP_HIST_CALLBACK], ns);
+	}
+	if (dsp->stall_ns && ns >= dsp->stall_ns)
+		_dispatcher_stall(dsp, evt, callback, fd, ns);
+}
+
 void _event_invoke_callback(struct event *ev, unsigned short reason,
 			   unsigned int events, bool reset_reason)
 {
-	int rc;
+	struct dispatcher *dsp = ev->dsp;
+	uint64_t start = 0;
+	cb_fn callback = ev->callback;
+	int rc, fd = ev->fd;
 
 	if (ev->reason) {
 		msg(LOG_DEBUG, "skipping callback for %s because of %s\n",
@@ -379,25 +715,110 @@ void _event_invoke_callback(struct event *ev, unsigned short reason,
 	}
 
 	ev->reason = reason;
-	rc = ev->callback(ev, events);
-
-	if (rc == EVENTCB_CLEANUP)
-		ev->flags |= __EV_CLEANUP;
-	else if (rc == EVENTCB_REMOVE)
-		ev->flags |= __EV_REMOVE;
+	if (dsp && ev->callback != timeout_event) {
+		dsp->stats.callbacks++;
+		if (_dispatcher_timed(dsp))
+			start = _mono_now();
+	}
+	TRACE3(callback_entry, ev, fd, reason);
+	rc = callback(ev, events);
+	TRACE4(callback_return, ev, fd, reason, rc);
+	if (start)
+		_dispatcher_callback_done(dsp, ev, callback, fd, start);
+
+	if (rc == EVENTCB_CLEANUP || rc == EVENTCB_REMOVE) {
+		ev->flags |= rc == EVENTCB_CLEANUP ? __EV_CLEANUP : __EV_REMOVE;
+		/* event_wait() will remove it after dispatching */
+		if (ev->dsp) {
+			ev->__next_pending = ev->dsp->pending;
+			ev->dsp->pending = ev;
+		}
+	}
 	if (reset_reason)
 		ev->reason = 0;
 }
 
 
+/*
+ * epoll_pwait() with a timespec timeout, @tmo == NULL waits forever.
+ * Use epoll_pwait2() directly, glibc supports it only since 2.35.
+ */
+static int _epoll_wait_ts(int ep_fd, struct epoll_event *events, int maxevents,
+			  const struct timespec *tmo, const sigset_t *sigmask)
+{
+	long ms;
+
+	if (tmo) {
+#ifdef SYS_epoll_pwait2
+		static bool no_pwait2;
+		int rc;
+
+		if (!no_pwait2) {
+			rc = syscall(SYS_epoll_pwait2, ep_fd, events, maxevents,
+				     tmo, sigmask, _NSIG / 8);
+			if (rc != -1 || errno != ENOSYS)
+				return rc;
+			msg(LOG_INFO, "epoll_pwait2 not supported, using epoll_pwait\n");
+			no_pwait2 = true;
+		}
+#endif
+		/* round up, don't wake up before the timeout expires */
+		ms = tmo->tv_sec * 1000L + (tmo->tv_nsec + 999999L) / 1000000L;
+		if (ms > INT_MAX)
+			ms = INT_MAX;
+	} else
+		ms = -1;
+	return epoll_pwait(ep_fd, events, maxevents, ms, sigmask);
+}
+
+/*
+ * Called before waiting, (re)allocate the buffer for epoll_pwait() if
+ * necessary. This isn't done in dispatcher_set_batch_size(), because
+ * callbacks run while event_wait() uses the buffer.
+ * In adaptive mode (@batch_min < @batch_max), double the size if the last
+ * batch was full, and halve it if it's been mostly unused for a while.
+ */
+static int _dispatcher_size_batch(struct dispatcher *dsp)
+{
+	unsigned int size = dsp->batch_size;
+	struct epoll_event *new;
+
+	if (size < dsp->batch_min)
+		size = dsp->batch_min;
+	else if (size > dsp->batch_max)
+		size = dsp->batch_max;
+	else if (dsp->batch_last == size) {
+		dsp->batch_idle = 0;
+		size = size > dsp->batch_max / 2 ? dsp->batch_max : 2 * size;
+	} else if (dsp->batch_last > size / 4)
+		dsp->batch_idle = 0;
+	else if (++dsp->batch_idle >= BATCH_IDLE_WAITS) {
+		dsp->batch_idle = 0;
+		size = size / 2 < dsp->batch_min ? dsp->batch_min : size / 2;
+	}
+
+	if (size == dsp->batch_size)
+		return 0;
+	new = realloc(dsp->ep_events, size * sizeof(*new));
+	if (!new) {
+		msg(LOG_WARNING, "failed to resize batch to %u: %m\n", size);
+		return dsp->ep_events ? 0 : -ENOMEM;
+	}
+	msg(LOG_DEBUG, "batch size %u -> %u\n", dsp->batch_size, size);
+	dsp->ep_events = new;
+	dsp->batch_size = size;
+	return 0;
+}
+
 int event_wait(struct dispatcher *dsp, const sigset_t *sigmask)
 {
 	int ep_fd = dispatcher_get_efd(dsp);
 	int rc, i;
-	unsigned int j;
+	unsigned int j, n_tmo, first = 0, pending = 0, fired = 0;
 	bool removed = false;
-	struct epoll_event events[MAX_EVENTS];
-	struct epoll_event *tmo_event = NULL;
+	uint64_t busy_ns;
+	struct epoll_event *events;
+	struct timespec tmo, next, *ptmo = NULL;
 
 	if (!dsp)
 		return -EINVAL;
@@ -405,30 +826,70 @@ int event_wait(struct dispatcher *dsp, const sigset_t *sigmask)
 		return -EBUSY;
 	if (ep_fd < 0)
 		return -EINVAL;
+	if ((rc = _dispatcher_size_batch(dsp)) < 0)
+		return rc;
+	events = dsp->ep_events;
 
-	rc = epoll_pwait(ep_fd, events, MAX_EVENTS, -1, sigmask);
+	/* Callbacks may add timeout handlers, only handle those we know here */
+	n_tmo = dsp->n_tmo_events;
+	for (j = 0; dsp->inline_timeouts && j < n_tmo; j++) {
+		if (!timeout_get_next(dsp->tmo_events[j], &next))
+			continue;
+		pending |= 1U << j;
+		if (!ptmo || ts_compare(&next, ptmo) < 0) {
+			tmo = next;
+			ptmo = &tmo;
+			first = j;
+		}
+	}
+
+	rc = _epoll_wait_ts(ep_fd, events, dsp->batch_size, ptmo, sigmask);
 	if (rc == -1) {
 		msg(errno == EINTR ? LOG_DEBUG : LOG_WARNING,
 		    "epoll_pwait: %m\n");
 		return -errno;
 	}
+	TRACE2(epoll_return, rc, dsp->batch_size);
+	dsp->batch_last = rc;
+	if (_dispatcher_timed(dsp))
+		dsp->wake_ns = _mono_now();
+	dsp->stats.wakeups++;
+	dsp->stats.events += rc;
+	if ((unsigned int)rc > dsp->stats.max_events)
+		dsp->stats.max_events = rc;
 
 	msg(LOG_DEBUG, "received %d events\n", rc);
+	for (j = 0; j < n_tmo; j++)
+		timeout_update_now(dsp->tmo_events[j]);
 	for (i = 0; i < rc; i++) {
 		struct event *ev = events[i].data.ptr;
 
-		if (ev == dsp->timeout_event)
-			tmo_event = &events[i];
-		else
+		if (ev->callback != timeout_event)
 			_event_invoke_callback(ev, REASON_EVENT_OCCURED,
 					       events[i].events, false);
 	}
 
-	if (tmo_event) {
-		struct event *ev = tmo_event->data.ptr;
+	/* Timeouts are handled after other events */
+	for (i = 0; i < rc; i++) {
+		struct event *ev = events[i].data.ptr;
 
+		if (ev->callback != timeout_event)
+			continue;
+		for (j = 0; j < n_tmo; j++)
+			if (ev == dsp->tmo_events[j])
+				fired |= 1U << j;
 		_event_invoke_callback(ev, REASON_EVENT_OCCURED,
-					    tmo_event->events, false);
+				       events[i].events, false);
+	}
+
+	for (j = 0; j < n_tmo; j++) {
+		if (fired & (1U << j))
+			continue;
+		else if (pending & (1U << j))
+			timeout_run(dsp->tmo_events[j], rc == 0 && j == first);
+		else if (rc > 0)
+			/* Don't let timeouts wait behind I/O if we're busy */
+			timeout_poll(dsp->tmo_events[j]);
 	}
 
 	for (i = 0; i < rc; i++) {
@@ -437,20 +898,26 @@ int event_wait(struct dispatcher *dsp, const sigset_t *sigmask)
 		ev->reason = 0;
 	}
 
-	for (j = 0; j < dsp->n; j++) {
-		struct event *ev = dsp->events[j];
+	while (dsp->pending) {
+		struct event *ev = dsp->pending;
 
-		if (ev && (ev->flags & (__EV_REMOVE | __EV_CLEANUP))) {
-			msg(LOG_DEBUG, "cleaning out event %u\n", j);
-			_event_remove(ev, false);
-			if (ev->flags & __EV_CLEANUP && ev->cleanup)
-				ev->cleanup(ev);
-			removed = true;
-		}
+		dsp->pending = ev->__next_pending;
+		ev->__next_pending = NULL;
+		msg(LOG_DEBUG, "cleaning out event %u\n", ev->__slot);
+		_event_remove(ev, false);
+		if (ev->flags & __EV_CLEANUP && ev->cleanup)
+			ev->cleanup(ev);
+		removed = true;
 	}
 	if (removed)
 		_dispatcher_gc(dsp);
 
+	for (j = 0; j < dsp->n_tmo_events; j++)
+		timeout_clear_now(dsp->tmo_events[j]);
+
+	if (dsp->stall_ns && dsp->wake_ns &&
+	    (busy_ns = _mono_now() - dsp->wake_ns) >= dsp->stall_ns)
+		_dispatcher_stall(dsp, NULL, NULL, -1, busy_ns);
 	return ELOOP_CONTINUE;
 }
 
@@ -492,6 +959,8 @@ int _call_timer_cb(struct event *evt, uint32_t events __attribute__((unused)))
 		return -EINVAL;
 
 	tim->timer_fn(tim->timer_arg);
+	if (evt->tmo_interval.tv_sec > 0 || evt->tmo_interval.tv_nsec > 0)
+		return EVENTCB_CONTINUE;
 	return EVENTCB_CLEANUP;
 }
 
@@ -501,3 +970,145 @@ int dispatcher_get_clocksource(const struct dispatcher *dsp)
 		return -EINVAL;
 	return timeout_get_clocksource(dsp->timeout_event);
 }
+
+int dispatcher_now(const struct dispatcher *dsp, struct timespec *now)
+{
+	if (!dsp || !now)
+		return -EINVAL;
+	return timeout_now(dsp->timeout_event, now);
+}
+
+int dispatcher_set_timer_slack(struct dispatcher *dsp,
+			       const struct timespec *slack)
+{
+	unsigned int i;
+	int rc;
+
+	if (!dsp || !slack)
+		return -EINVAL;
+	for (i = 0; i < dsp->n_tmo_events; i++)
+		if ((rc = timeout_set_slack(dsp->tmo_events[i], slack)) < 0)
+			return rc;
+	dsp->slack = *slack;
+	return 0;
+}
+
+int dispatcher_set_batch_size(struct dispatcher *dsp, unsigned int min,
+			      unsigned int max)
+{
+	if (!dsp || min == 0 || min > max || max > MAX_BATCH_SIZE)
+		return -EINVAL;
+	dsp->batch_min = min;
+	dsp->batch_max = max;
+	dsp->batch_idle = 0;
+	return 0;
+}
+
+int dispatcher_get_stats(const struct dispatcher *dsp,
+			 struct dispatcher_stats *stats)
+{
+	struct timeout_stats st;
+	size_t pending, capacity;
+	unsigned int i;
+
+	if (!dsp || !stats)
+		return -EINVAL;
+
+	*stats = dsp->stats;
+	stats->n_events = dsp->n - dsp->free;
+	stats->registry_used = dsp->n;
+	stats->registry_free = dsp->free;
+	stats->registry_len = dsp->len;
+	stats->batch_size = dsp->batch_size;
+	stats->registry_bytes = dsp->len * sizeof(*dsp->events) +
+		dsp->batch_size * sizeof(*dsp->ep_events);
+
+	for (i = 0; i < dsp->n_tmo_events; i++) {
+		timeout_get_stats(dsp->tmo_events[i], &st);
+		stats->expired += st.expired;
+		stats->settime_calls += st.settime_calls;
+		stats->timeout_bytes +=
+			timeout_get_usage(dsp->tmo_events[i], &pending, &capacity);
+		stats->n_timeouts += pending;
+		stats->timeout_capacity += capacity;
+	}
+	return 0;
+}
+
+int dispatcher_set_histograms(struct dispatcher *dsp, bool enable)
+{
+	struct histogram *hist = NULL;
+	unsigned int i;
+
+	if (!dsp)
+		return -EINVAL;
+	if (enable) {
+		hist = calloc(__DSP_HIST_MAX, sizeof(*hist));
+		if (!hist)
+			return -ENOMEM;
+	}
+	for (i = 0; i < dsp->n_tmo_events; i++)
+		timeout_set_histogram(dsp->tmo_events[i],
+				      hist ? &hist[DSP_HIST_LATENESS] : NULL);
+	free(dsp->hist);
+	dsp->hist = hist;
+	/* if called from a callback, measure the rest of the batch from now */
+	if (hist)
+		dsp->wake_ns = _mono_now();
+	return 0;
+}
+
+int dispatcher_set_watchdog(struct dispatcher *dsp,
+			    const struct timespec *threshold,
+			    stall_fn hook, void *arg)
+{
+	if (!dsp || !threshold || threshold->tv_sec < 0 ||
+	    threshold->tv_nsec < 0 || threshold->tv_nsec >= 1000000000L)
+		return -EINVAL;
+	/* if called from a callback, measure the rest of the batch from now */
+	if (!_dispatcher_timed(dsp))
+		dsp->wake_ns = _mono_now();
+	dsp->stall_ns = threshold->tv_sec * 1000000000ULL + threshold->tv_nsec;
+	dsp->stall_hook = hook;
+	dsp->stall_arg = arg;
+	return 0;
+}
+
+int dispatcher_get_percentile(const struct dispatcher *dsp,
+			      enum dsp_histogram hist, double percent,
+			      unsigned long long *ns)
+{
+	if (!dsp || hist >= __DSP_HIST_MAX || !ns ||
+	    !(percent >= 0 && percent <= 100))
+		return -EINVAL;
+	if (!dsp->hist)
+		return -ENODATA;
+	*ns = histogram_percentile(&dsp->hist[hist], percent);
+	return dsp->hist[hist].count > 0 ? 0 : -ENODATA;
+}
+
+int dispatcher_get_timeout_stats(const struct dispatcher *dsp,
+				 struct timeout_stats *stats)
+{
+	struct timeout_stats st;
+	unsigned int i;
+
+	if (!dsp || !stats)
+		return -EINVAL;
+	timeout_get_stats(dsp->timeout_event, stats);
+	/* Sum up the statistics of all clocks */
+	for (i = 1; i < dsp->n_tmo_events; i++) {
+		timeout_get_stats(dsp->tmo_events[i], &st);
+		stats->wakeups_saved += st.wakeups_saved;
+		stats->missed_ticks += st.missed_ticks;
+		stats->settime_calls += st.settime_calls;
+		stats->settime_avoided += st.settime_avoided;
+		stats->polled += st.polled;
+		stats->expired += st.expired;
+		stats->total_lateness_ns += st.total_lateness_ns;
+		if (st.max_lateness_ns > stats->max_lateness_ns)
+			stats->max_lateness_ns = st.max_lateness_ns;
+		stats->clock_steps += st.clock_steps;
+	}
+	return 0;
+}
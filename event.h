@@ -48,9 +48,28 @@ enum {
 	 * Used in event_add() and event_modify_timeout()
 	 */
 	TMO_ABS = 1,
+	/*
+	 * lazy timeout refresh, see event_mod_timeout()
+	 */
+	TMO_LAZY = 2,
+	/*
+	 * clock for the timeout. TMO_CLOCK_DEFAULT uses the clock source
+	 * of the dispatcher. Don't change these bits after event_add().
+	 */
+	TMO_CLOCK_DEFAULT = 0,
+	TMO_CLOCK_MONOTONIC = (1 << 2),
+	TMO_CLOCK_BOOTTIME = (2 << 2),
+	TMO_CLOCK_REALTIME = (3 << 2),
+	TMO_CLOCK_MASK = (3 << 2),
 	/* the flags below are for internal use only, don't touch them */
 	__EV_REMOVE = (1 << 8),
 	__EV_CLEANUP = (1 << 9),
+	/* the event is in the dispatcher's timeout store */
+	__EV_TIMEOUT = (1 << 10),
+	/* the event is queued in a timeout class */
+	__EV_TMO_CLASS = (1 << 11),
+	/* lazy refresh: the real deadline is in __tmo_due */
+	__EV_TMO_DEFER = (1 << 12),
 };
 
 /**
@@ -130,10 +149,41 @@ void cleanup_event_on_heap(struct event *evt);
  *      event_add(), after event_finish(), it may be set again. The field
  *      may be modified by the dispatcher code. To change the timeout,
  *      call event_mod_timeout().
- * @flags: See above. Currently only @TMO_ABS is supported. This field may
- *      be used internally by the dispatcher, be sure to set or clear only
- *      public bits.
- */
+ * @flags: See above. @TMO_ABS, @TMO_LAZY, and the TMO_CLOCK_xxx values are
+ *      supported. This field may be used internally by the dispatcher, be
+ *      sure to set or clear only public bits.
+ *      The dispatcher keeps a separate timeout store (and timerfd) for every
+ *      clock which is used by any event, so that e.g. monotonic idle
+ *      timeouts and wall clock (@TMO_ABS | @TMO_CLOCK_REALTIME) deadlines
+ *      can be handled by the same dispatcher.
+ * @tmo_class: timeout class, see dispatcher_add_tmo_class(). If non-zero
+ *      in the call to event_add(), the event gets the timeout of this class,
+ *      and @tmo is ignored. Timeout classes can only be used with the
+ *      dispatcher's clock source. Don't change this field after calling
+ *      event_add(), use event_mod_tmo_class() or event_mod_timeout().
+ * @tmo_missed: for periodic timers, the number of periods which were skipped
+ *      before the current callback invocation because the dispatcher couldn't
+ *      keep up. Set by the dispatcher before calling the callback.
+ * @tmo_interval: if non-zero, the event is a periodic timer. After the
+ *      timeout expires, it's automatically re-armed for the next multiple of
+ *      @tmo_interval after the expired deadline, unless the callback sets a
+ *      new timeout or cancels it with event_mod_timeout(). If @tmo is 0 in
+ *      the call to event_add(), the first timeout expires after
+ *      @tmo_interval. Ignored for events in a timeout class. Can be
+ *      changed at any time; set it to 0 to stop the timer after the
+ *      next expiry.
+ * @__slot, @__gen: registry handle of the event in the dispatcher.
+ *      Set by event_add(), USED INTERNALLY. Never touch these fields.
+ * @__next_pending: link in the dispatcher's list of events to be removed.
+ *      USED INTERNALLY.
+ * @__tmo_pos, @__tmo_link: position of the event in the timeout store.
+ *      USED INTERNALLY.
+ * @__tmo_due: deadline of a lazily refreshed timeout. USED INTERNALLY.
+ */
+
+struct __tmo_link {
+	struct __tmo_link *next, *prev;
+};
 
 struct event {
 	struct epoll_event ep;
@@ -144,6 +194,17 @@ struct event {
 	struct timespec tmo;
 	cb_fn callback;
 	cleanup_fn cleanup;
+	unsigned int tmo_class;
+	unsigned int tmo_missed;
+	struct timespec tmo_interval;
+	unsigned int __slot;
+	unsigned int __gen;
+	struct event *__next_pending;
+	struct timespec __tmo_due;
+	union {
+		long __tmo_pos;
+		struct __tmo_link __tmo_link;
+	};
 };
 
 /**
@@ -153,6 +214,7 @@ struct event {
  * @event: an event structure. See the description above for the
  *
  * Return: 0 on success, negative error code (-errno) on failure.
+ * On failure, the event isn't registered with the dispatcher.
  */
 int event_add(struct dispatcher *dsp, struct event *event);
 
@@ -171,6 +233,46 @@ int event_add(struct dispatcher *dsp, struct event *event);
  */
 int event_remove(struct event *event);
 
+/**
+ * event_add_many() - add several events at once
+ *
+ * @dispatcher: a dispatcher object
+ * @events: array of @n event structures, see event_add()
+ * @n: number of elements in @events
+ *
+ * Like calling event_add() for every element of @events, but faster
+ * for large numbers of events: memory for the registry and the timeouts
+ * is reserved only once, the timeouts are sorted in one go, and the timer
+ * is re-armed at most once. Either all events are added, or none.
+ *
+ * Return: 0 on success, negative error code (-errno) on failure.
+ */
+int event_add_many(struct dispatcher *dsp, struct event * const *events,
+		   unsigned int n);
+
+/**
+ * event_remove_many() - remove several events at once
+ *
+ * @dispatcher: the dispatcher the events were added to
+ * @events: array of @n previously added event structures
+ * @n: number of elements in @events
+ *
+ * Like calling event_remove() for every element of @events, but the
+ * timer is re-armed at most once, and the memory of the registry and the
+ * timeouts is compacted only once. Elements of @events that are NULL or
+ * don't belong to @dispatcher aren't touched, but the others are removed
+ * anyway, and -EINVAL is returned.
+ *
+ * CAUTION: don't call this from callbacks. Use EVENTCB_xxx return codes
+ * instead.
+ *
+ * Return: 0 on success, negative error code (-errno) if removing any
+ * of the events failed. All events which could be removed have been
+ * removed in either case.
+ */
+int event_remove_many(struct dispatcher *dsp, struct event * const *events,
+		      unsigned int n);
+
 /**
  * event_modify() - modify epoll events to wait for
  *
@@ -205,12 +307,64 @@ int event_modify(struct event *event);
  * NOTE: if the callback is called with reason REASON_TIMEOUT, the timeout
  * has expired and *must* be rearmed if the event is monitored further.
  * Otherwise, the timeout will implicitly be changed to "infinite", because
- * there is no timeout for this event any more.
+ * there is no timeout for this event any more. Periodic timers (see
+ * @tmo_interval in struct event) are re-armed automatically.
+ *
+ * If the event was in a timeout class, it's taken out of it, and
+ * @event->tmo_class is set to 0.
+ *
+ * If @TMO_LAZY is set in @event->flags, and the new timeout expires later
+ * than the current one, only the new deadline is recorded. The timeout
+ * store is updated when the old deadline expires, without calling the
+ * callback. This makes refreshing idle timeouts very cheap, at the cost
+ * of an extra wakeup when the old deadline is reached. In this case,
+ * @event->tmo keeps the old deadline until then. If the timeout can't
+ * be stored at that point (out of memory), an error is logged, and the
+ * event is left without timeout. The callback is never called before the
+ * new deadline.
  *
  * Return: 0 on success, negative error code (-errno) on failure.
  */
 int event_mod_timeout(struct event *event, const struct timespec *tmo);
 
+/**
+ * dispatcher_add_tmo_class() - register a timeout class
+ *
+ * @dsp: a dispatcher object
+ * @duration: the relative timeout for events in this class, must be positive
+ *
+ * Many applications use only a few different, constant, relative timeouts.
+ * Events using such timeouts can be put into a timeout class by setting
+ * @event->tmo_class before event_add(), or by calling event_mod_tmo_class().
+ * Because every new timeout in a class expires after all others in the same
+ * class, these events are kept in a simple FIFO list. Adding, refreshing,
+ * and cancelling their timeouts costs O(1), regardless of the timeout store
+ * selected with new_dispatcher_ext().
+ *
+ * Registering the same @duration twice returns the same class.
+ *
+ * Return: the class ID (positive) on success, negative error code
+ * (-errno) on failure.
+ */
+int dispatcher_add_tmo_class(struct dispatcher *dsp,
+			     const struct timespec *duration);
+
+/**
+ * event_mod_tmo_class() - (re)arm the timeout of an event using a class
+ *
+ * @event: a previously added event structure
+ * @tmo_class: a class ID returned from dispatcher_add_tmo_class(), or 0
+ *
+ * Set the timeout of @event to the duration of @tmo_class, counted from
+ * now. This can be used to refresh the timeout of an event which is
+ * already in the class, or to move it to a different class. If @tmo_class
+ * is 0, an existing timeout is cleared. Like event_mod_timeout(), this
+ * must be called from the callback to re-arm an expired timeout.
+ *
+ * Return: 0 on success, negative error code (-errno) on failure.
+ */
+int event_mod_tmo_class(struct event *event, unsigned int tmo_class);
+
 /**
  * int _event_invoke_callback - handle callback invocation
  * @reason: one of the reason codes above
@@ -307,10 +461,71 @@ void free_dispatcher(struct dispatcher *dsp);
  * @clocksrc: one of the supported clock sources of the system,
  *            see clock_gettime(2). It will be used for timeout handling.
  *
+ * If @clocksrc is CLOCK_REALTIME, the dispatcher detects when the clock
+ * is set, and moves all relative timeouts by the same amount, so that
+ * they still expire after the requested time. Absolute timeouts
+ * (@TMO_ABS) are unaffected.
+ *
  * Return: NULL on failure, a valid pointer otherwise.
  */
 struct dispatcher *new_dispatcher(int clocksrc);
 
+/**
+ * Flags for new_dispatcher_ext()
+ *
+ * The DSP_TMO_xxx values select the data structure used for storing
+ * timeouts. They are mutually exclusive.
+ * @DSP_TMO_SORTED: sorted array (default). Fast expiry and lookup of
+ *      the next timeout, but adding, modifying and cancelling timeouts
+ *      costs O(n). Good for a moderate number of timeouts.
+ * @DSP_TMO_HEAP: 4-ary heap. Adding, modifying and cancelling timeouts
+ *      costs O(log n). Use this for large numbers of timeouts.
+ * @DSP_TMO_WHEEL: hierarchical timing wheel with 1ms resolution. Adding
+ *      and cancelling timeouts costs O(1). Timeouts are rounded up to the
+ *      next millisecond and may fire up to 1ms late. Use this for very
+ *      large numbers of coarse timeouts which are mostly cancelled
+ *      before they expire.
+ *
+ * @DSP_NO_TIMERFD: don't use a timerfd for timeouts. Instead, event_wait()
+ *      passes the time until the next timeout to epoll_pwait2(), and
+ *      handles expired timeouts after it returns. This saves a file
+ *      descriptor and two system calls per timer expiry.
+ *      Applications which call epoll_wait() on dispatcher_get_efd()
+ *      themselves can't use this. The time until the next timeout is
+ *      measured on @clocksrc, but epoll_pwait2() waits on CLOCK_MONOTONIC,
+ *      thus changes of CLOCK_REALTIME aren't tracked.
+ *      On kernels without epoll_pwait2() (before 5.11), epoll_pwait() is
+ *      used, and timeouts are rounded up to milliseconds.
+ *
+ * @DSP_COARSE_CLOCK: use CLOCK_MONOTONIC_COARSE or CLOCK_REALTIME_COARSE
+ *      rather than CLOCK_MONOTONIC or CLOCK_REALTIME, respectively, for
+ *      dispatcher_now() outside of event_wait(). Reading these clocks is
+ *      cheaper, but their resolution is only one kernel tick (1-10ms).
+ *      Relative timeouts are always calculated with the precise clock,
+ *      so that they never expire early. Other clock sources are used
+ *      unchanged.
+ */
+enum {
+	DSP_TMO_SORTED = 0,
+	DSP_TMO_HEAP = 1,
+	DSP_TMO_WHEEL = 2,
+	DSP_TMO_MASK = 3,
+	DSP_NO_TIMERFD = 4,
+	DSP_COARSE_CLOCK = 8,
+};
+
+/**
+ * new_dispatcher_ext() - allocate a new dispatcher object with options
+ *
+ * @clocksrc: see new_dispatcher().
+ * @flags: bitmask of DSP_xxx flags (see above).
+ *
+ * new_dispatcher(clocksrc) is equivalent to new_dispatcher_ext(clocksrc, 0).
+ *
+ * Return: NULL on failure, a valid pointer otherwise.
+ */
+struct dispatcher *new_dispatcher_ext(int clocksrc, unsigned int flags);
+
 /**
  * dispatcher_get_efd() - obtain the epoll file descriptor
  *
@@ -331,6 +546,254 @@ int dispatcher_get_efd(const struct dispatcher *dsp);
  */
 int dispatcher_get_clocksource(const struct dispatcher *dsp);
 
+/**
+ * dispatcher_now() - obtain the current time of the dispatcher's clock
+ *
+ * @dsp: a dispatcher object
+ * @now: buffer for the result
+ *
+ * The time is that of the dispatcher's clock source, see new_dispatcher().
+ * While event_wait() dispatches events, the time is read once after
+ * waking up, and expired timeouts are determined using this time, too.
+ * Callbacks can use this function to obtain the cached time cheaply. Relative timeouts
+ * passed to event_add() or event_mod_timeout() from callbacks are
+ * relative to this time, too. Outside event_wait(), the clock is read.
+ *
+ * Return: 0 on success, negative error code (-errno) on failure.
+ */
+int dispatcher_now(const struct dispatcher *dsp, struct timespec *now);
+
+/**
+ * dispatcher_set_timer_slack() - allow timeouts to fire late
+ *
+ * @dsp: a dispatcher object
+ * @slack: the maximum delay, {0, 0} (the default) for no slack
+ *
+ * With a non-zero slack, the timer is armed for the next multiple of @slack
+ * after the earliest timeout, and all timeouts expiring until then are
+ * handled in a single wakeup. Timeouts never fire early, but up to @slack
+ * late. Use this if many timeouts don't need to be precise.
+ *
+ * Return: 0 on success, negative error code (-errno) on failure.
+ */
+int dispatcher_set_timer_slack(struct dispatcher *dsp,
+			       const struct timespec *slack);
+
+/**
+ * dispatcher_set_batch_size() - set the number of events received at once
+ *
+ * @dsp: a dispatcher object
+ * @min: the minimum batch size
+ * @max: the maximum batch size, at most 65536
+ *
+ * event_wait() receives up to "batch size" events with a single call to
+ * epoll_pwait(). If many file descriptors become ready at the same time,
+ * a larger batch size saves system calls. If @min equals @max, the batch
+ * size is fixed. Otherwise, it adapts to the load: it's doubled whenever
+ * a batch comes back full, and halved after 64 waits which used at most
+ * a quarter of it. The default is a fixed batch size of 8. Changes take
+ * effect with the next call to event_wait().
+ *
+ * Return: 0 on success, negative error code (-errno) on failure.
+ *  -EINVAL: @min is 0, or larger than @max, or @max is too large.
+ */
+int dispatcher_set_batch_size(struct dispatcher *dsp, unsigned int min,
+			      unsigned int max);
+
+/**
+ * struct timeout_stats - statistics of timeout handling
+ *
+ * @wakeups_saved: number of distinct deadlines which were handled in the
+ *      wakeup for an earlier deadline because of the timer slack.
+ * @missed_ticks: total number of skipped periods of periodic timers.
+ * @settime_calls: number of timerfd_settime() calls.
+ * @settime_avoided: number of times the timer was left armed for an earlier
+ *      (or the same) time rather than calling timerfd_settime(). This may
+ *      cause spurious wakeups, which are cheaper than the system calls in
+ *      most workloads.
+ * @polled: number of times expired timeouts were found and handled after
+ *      dispatching other events, without a wakeup by the timer.
+ * @expired: number of timeouts which expired and whose callbacks were called.
+ * @total_lateness_ns: sum of the delays between the expiry of these
+ *      timeouts and the time the dispatcher started processing them.
+ * @max_lateness_ns: the maximum of these delays.
+ * @clock_steps: number of times the realtime clock was set, and the
+ *      pending relative timeouts of a CLOCK_REALTIME timer were adjusted.
+ */
+struct timeout_stats {
+	unsigned long long wakeups_saved;
+	unsigned long long missed_ticks;
+	unsigned long long settime_calls;
+	unsigned long long settime_avoided;
+	unsigned long long polled;
+	unsigned long long expired;
+	unsigned long long total_lateness_ns;
+	unsigned long long max_lateness_ns;
+	unsigned long long clock_steps;
+};
+
+/**
+ * dispatcher_get_timeout_stats() - obtain timeout statistics
+ *
+ * @dsp: a dispatcher object
+ * @stats: buffer for the result
+ *
+ * Return: 0 on success, negative error code (-errno) on failure.
+ */
+int dispatcher_get_timeout_stats(const struct dispatcher *dsp,
+				 struct timeout_stats *stats);
+
+/**
+ * struct dispatcher_stats - runtime statistics of a dispatcher
+ *
+ * @wakeups: number of times event_wait() returned from epoll_pwait(),
+ *      including timeouts of the wait itself (see @DSP_NO_TIMERFD).
+ * @events: number of events received from epoll_pwait(), including those
+ *      of the timerfds. @events / @wakeups is the average batch size.
+ * @max_events: the largest number of events received in one wakeup.
+ * @callbacks: number of event callbacks called, for I/O and timeouts.
+ * @expired: number of expired timeouts, see struct timeout_stats.
+ * @settime_calls: number of timerfd_settime() calls, see struct timeout_stats.
+ * @slow_callbacks: number of callbacks which exceeded the watchdog
+ *      threshold, see dispatcher_set_watchdog().
+ * @loop_stalls: number of wakeups for which dispatching all events
+ *      exceeded the watchdog threshold.
+ * @n_events: number of registered events.
+ * @registry_used: number of slots of the event registry which are in use
+ *      or on the free list.
+ * @registry_free: number of slots on the free list.
+ * @registry_len: number of allocated slots of the event registry.
+ * @batch_size: current epoll batch size, see dispatcher_set_batch_size().
+ * @n_timeouts: number of pending timeouts, for all clocks.
+ * @timeout_capacity: number of timeouts the arrays of the timeout stores
+ *      can hold without growing, 0 for @DSP_TMO_WHEEL.
+ * @registry_bytes: memory allocated for the event registry and the epoll
+ *      buffer.
+ * @timeout_bytes: memory allocated for the timeout stores.
+ *
+ * The counters are updated by the thread running the event loop without
+ * any locking.
+ */
+struct dispatcher_stats {
+	unsigned long long wakeups;
+	unsigned long long events;
+	unsigned long long max_events;
+	unsigned long long callbacks;
+	unsigned long long expired;
+	unsigned long long settime_calls;
+	unsigned long long slow_callbacks;
+	unsigned long long loop_stalls;
+	unsigned int n_events;
+	unsigned int registry_used;
+	unsigned int registry_free;
+	unsigned int registry_len;
+	unsigned int batch_size;
+	size_t n_timeouts;
+	size_t timeout_capacity;
+	size_t registry_bytes;
+	size_t timeout_bytes;
+};
+
+/**
+ * dispatcher_get_stats() - obtain runtime statistics and memory usage
+ *
+ * @dsp: a dispatcher object
+ * @stats: buffer for the result
+ *
+ * Return: 0 on success, negative error code (-errno) on failure.
+ */
+int dispatcher_get_stats(const struct dispatcher *dsp,
+			 struct dispatcher_stats *stats);
+
+/**
+ * enum dsp_histogram - latency histograms of a dispatcher
+ *
+ * @DSP_HIST_LATENESS: lateness of timeouts, the time between the deadline
+ *      and the time the dispatcher started processing the expired timeout.
+ * @DSP_HIST_CALLBACK: run time of event callbacks, for I/O and timeouts.
+ * @DSP_HIST_DISPATCH: the time between the return of epoll_pwait() and
+ *      the start of an event callback.
+ *
+ * All times are measured with CLOCK_MONOTONIC in ns. The lateness is
+ * measured with the clock of the respective timeout.
+ */
+enum dsp_histogram {
+	DSP_HIST_LATENESS,
+	DSP_HIST_CALLBACK,
+	DSP_HIST_DISPATCH,
+	__DSP_HIST_MAX,
+};
+
+/**
+ * dispatcher_set_histograms() - enable or disable latency histograms
+ *
+ * @dsp: a dispatcher object
+ * @enable: true to enable, false to disable
+ *
+ * Histograms are disabled by default. If enabled, the dispatcher records
+ * the durations described for enum dsp_histogram in log-linear histograms
+ * with a relative error of less than 1/16. This costs two clock_gettime()
+ * calls per callback, and one per wakeup. Enabling the histograms if
+ * they're enabled already clears them.
+ *
+ * Return: 0 on success, negative error code (-errno) on failure.
+ */
+int dispatcher_set_histograms(struct dispatcher *dsp, bool enable);
+
+/**
+ * dispatcher_get_percentile() - obtain a percentile of a latency histogram
+ *
+ * @dsp: a dispatcher object
+ * @hist: the histogram, see enum dsp_histogram
+ * @percent: the percentile, e.g. 99.9 for the p999 latency
+ * @ns: buffer for the result, in ns
+ *
+ * Return: 0 on success, negative error code (-errno) on failure.
+ *  -EINVAL: invalid parameters, or @percent not between 0 and 100.
+ *  -ENODATA: histograms are disabled, or no values have been recorded yet.
+ */
+int dispatcher_get_percentile(const struct dispatcher *dsp,
+			      enum dsp_histogram hist, double percent,
+			      unsigned long long *ns);
+
+/**
+ * Prototype for the watchdog hook, see dispatcher_set_watchdog().
+ * @evt: the event whose callback was slow, or NULL if the dispatcher
+ *      took too long to handle all events of one wakeup
+ * @callback: the callback that was called, NULL if @evt is NULL
+ * @fd: the file descriptor of @evt at the time of the call, -1 if @evt
+ *      is NULL
+ * @ns: the run time of the callback, or of the whole wakeup, in ns
+ * @arg: the argument passed to dispatcher_set_watchdog()
+ *
+ * The hook is called from event_wait() after the callback has returned.
+ * @evt may have been freed by the callback already; use it for
+ * identification only, and don't dereference it.
+ */
+typedef void (*stall_fn)(const struct event *evt, cb_fn callback, int fd,
+			 unsigned long long ns, void *arg);
+
+/**
+ * dispatcher_set_watchdog() - report slow callbacks and loop stalls
+ *
+ * @dsp: a dispatcher object
+ * @threshold: the maximum run time, {0, 0} (the default) to disable
+ * @hook: the function to call, NULL to log a warning
+ * @arg: argument for @hook
+ *
+ * With a non-zero @threshold, event_wait() measures the run time of every
+ * callback, and the time from the return of epoll_pwait() until all events
+ * have been handled, with CLOCK_MONOTONIC. If either exceeds @threshold,
+ * @hook is called. The check is done after the callback returns, thus it
+ * can't interrupt a callback which is stuck. This costs two
+ * clock_gettime() calls per callback, and two per wakeup.
+ *
+ * Return: 0 on success, negative error code (-errno) on failure.
+ */
+int dispatcher_set_watchdog(struct dispatcher *dsp,
+			    const struct timespec *threshold,
+			    stall_fn hook, void *arg);
+
 /**
  * Convenenience macros for event initialization
  *
@@ -414,7 +877,38 @@ int dispatcher_get_clocksource(const struct dispatcher *dsp);
 		     (us) / 1000000L, (us) % 1000000L * 1000 + 1)
 
 /**
- * timer_cb - prototype for a generic single-shot timer callback
+ * __PERIODIC_INIT() - generic periodic timer initializer
+ */
+#define __PERIODIC_INIT(cb, cln, us)				\
+	((struct event){					\
+		.fd = -1,					\
+		.callback = (cb),				\
+		.cleanup = (cln),				\
+		.tmo_interval.tv_sec  = (us) / 1000000L,	\
+		.tmo_interval.tv_nsec = (us) % 1000000L * 1000,	\
+	})
+
+/**
+ * PERIODIC_TIMER_EVENT_ON_STACK() - initializer for struct event
+ * @cb: callback of type @cb_fn
+ * @us: interval in microseconds, must be positive
+ *
+ * The timer first fires @us microseconds after event_add(), and then
+ * every @us microseconds, until the callback cancels it.
+ */
+#define PERIODIC_TIMER_EVENT_ON_STACK(cb, us)			\
+	__PERIODIC_INIT(cb, cleanup_event_on_stack, us)
+
+/**
+ * PERIODIC_TIMER_EVENT_ON_HEAP() - initializer for struct event
+ * Like PERIODIC_TIMER_EVENT_ON_STACK(), but the cleanup callback
+ * will free the struct event.
+ */
+#define PERIODIC_TIMER_EVENT_ON_HEAP(cb, us)			\
+	__PERIODIC_INIT(cb, cleanup_event_on_heap, us)
+
+/**
+ * timer_cb - prototype for a generic timer callback
  * Use the TIMER macros below.
  */
 typedef void (*timer_cb)(void *arg);
@@ -460,4 +954,32 @@ struct timer_event {
 		.timer_arg = arg,					\
 	})
 
+/**
+ * PERIODIC_TIMER_ON_STACK() - initializer for a periodic timer
+ * @fn: callback of type @timer_cb
+ * @arg: argument to pass to @fn
+ * @us: interval in microseconds
+ *
+ * @fn is called every @us microseconds until the event is removed,
+ * or @e.tmo_interval is set to 0.
+ */
+#define PERIODIC_TIMER_ON_STACK(fn, arg, us)				\
+	((struct timer_event){						\
+		.e = PERIODIC_TIMER_EVENT_ON_STACK(_call_timer_cb, us),	\
+		.timer_fn = fn,						\
+		.timer_arg = arg,					\
+	})
+
+/**
+ * PERIODIC_TIMER_ON_HEAP() - initializer for a periodic timer
+ * Like PERIODIC_TIMER_ON_STACK(), but the cleanup callback
+ * will free the struct event.
+ */
+#define PERIODIC_TIMER_ON_HEAP(fn, arg, us)				\
+	((struct timer_event){						\
+		.e = PERIODIC_TIMER_EVENT_ON_HEAP(_call_timer_cb, us),	\
+		.timer_fn = fn,						\
+		.timer_arg = arg,					\
+	})
+
 #endif
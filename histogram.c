@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2021 Martin Wilck, SUSE LLC
+ * SPDX-License-Identifier: LGPL-2.1-or-newer
+ */
+#include <stdint.h>
+#include <string.h>
+#include "histogram.h"
+
+#define HIST_SUB_COUNT (1U << HIST_SUB_BITS)
+
+/*
+ * Values below HIST_SUB_COUNT have a bucket each. Above, the bucket is
+ * determined by the position of the highest set bit (the "exponent"),
+ * and the HIST_SUB_BITS bits below it.
+ */
+static unsigned int histogram_index(uint64_t val)
+{
+	unsigned int exp;
+
+	if (val < HIST_SUB_COUNT)
+		return val;
+	if (val >> HIST_MAX_BITS)
+		return HIST_BUCKETS - 1;
+	exp = 63 - __builtin_clzll(val);
+	return ((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+		((val >> (exp - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+}
+
+/* The highest value recorded in bucket @idx */
+static uint64_t histogram_bucket_max(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < HIST_SUB_COUNT)
+		return idx;
+	shift = (idx >> HIST_SUB_BITS) - 1;
+	return ((uint64_t)(HIST_SUB_COUNT + (idx & (HIST_SUB_COUNT - 1)) + 1)
+		<< shift) - 1;
+}
+
+void histogram_add(struct histogram *hist, uint64_t val)
+{
+	hist->buckets[histogram_index(val)]++;
+	hist->count++;
+	if (val > hist->max)
+		hist->max = val;
+}
+
+uint64_t histogram_percentile(const struct histogram *hist, double percent)
+{
+	uint64_t rank, sum = 0, val;
+	unsigned int i;
+
+	if (hist->count == 0)
+		return 0;
+	if (percent <= 0)
+		rank = 1;
+	else if (percent >= 100)
+		return hist->max;
+	else {
+		/* The smallest value which at least @percent % don't exceed */
+		rank = (uint64_t)(percent / 100 * hist->count);
+		if (rank < percent / 100 * hist->count || rank == 0)
+			rank++;
+	}
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		sum += hist->buckets[i];
+		if (sum >= rank)
+			break;
+	}
+	val = histogram_bucket_max(i);
+	return val < hist->max ? val : hist->max;
+}
+
+void histogram_reset(struct histogram *hist)
+{
+	memset(hist, 0, sizeof(*hist));
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2021 Martin Wilck, SUSE LLC
+ * SPDX-License-Identifier: LGPL-2.1-or-newer
+ */
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+/*
+ * Log-linear histograms of durations in ns, like HdrHistogram: every power
+ * of two is split into 2^HIST_SUB_BITS buckets of equal width, thus the
+ * relative error of a recorded value is less than 1/2^HIST_SUB_BITS.
+ * Values of 2^HIST_MAX_BITS ns (about 18 minutes) and more are recorded
+ * in the last bucket.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct histogram {
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+/**
+ * histogram_add() - record a value
+ * @hist: the histogram
+ * @val: the value to record
+ */
+void histogram_add(struct histogram *hist, uint64_t val);
+
+/**
+ * histogram_percentile() - obtain a percentile
+ * @hist: the histogram
+ * @percent: the percentile, between 0 and 100
+ *
+ * Return: the highest value that falls into the same bucket as the
+ * value at @percent, but at most the largest recorded value. 0 if
+ * the histogram is empty.
+ */
+uint64_t histogram_percentile(const struct histogram *hist, double percent);
+
+/**
+ * histogram_reset() - clear all recorded values
+ * @hist: the histogram
+ */
+void histogram_reset(struct histogram *hist);
+
+#endif
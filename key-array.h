@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2021 Martin Wilck, SUSE LLC
+ * SPDX-License-Identifier: LGPL-2.1-or-newer
+ */
+#ifndef _KEY_ARRAY_H
+#define _KEY_ARRAY_H
+
+/*
+ * Templates for arrays which are sorted by 64-bit unsigned keys, shared by
+ * time-util.c and timeout.c. @MEMB selects the key of an element: ".key"
+ * for an array of structures with a "key" member, or nothing for an array
+ * of uint64_t.
+ *
+ * Don't include other headers here, time-util.c is run through the
+ * preprocessor to create ts-util.c and tv-util.c. Users need <stddef.h>,
+ * <stdint.h> and <string.h>.
+ */
+
+/* Below this size, qsort() is faster than the radix sort */
+#define KEY_RADIX_MIN 256
+
+/*
+ * LSD radix sort by key, 8 bits per pass. The histograms for all passes
+ * are collected in one go, and passes in which all keys have the same
+ * digit (typically the upper bytes) are skipped. @tmp must have room for
+ * @n elements. Return the buffer which holds the result.
+ */
+#define KEY_RADIX_SORT(NAME, TYPE, MEMB)				\
+TYPE *NAME(TYPE *arr, TYPE *tmp, size_t n)				\
+{									\
+	size_t count[8][256];						\
+	TYPE *swap;							\
+	unsigned int pass, d;						\
+	size_t i, pos, c;						\
+									\
+	memset(count, 0, sizeof(count));				\
+	for (i = 0; i < n; i++)						\
+		for (pass = 0; pass < 8; pass++)			\
+			count[pass][(arr[i]MEMB >> (8 * pass)) & 0xff]++;	\
+									\
+	for (pass = 0; pass < 8; pass++) {				\
+		if (count[pass][(arr[0]MEMB >> (8 * pass)) & 0xff] == n)	\
+			continue;					\
+		for (d = 0, pos = 0; d < 256; d++) {			\
+			c = count[pass][d];				\
+			count[pass][d] = pos;				\
+			pos += c;					\
+		}							\
+		for (i = 0; i < n; i++) {				\
+			d = (arr[i]MEMB >> (8 * pass)) & 0xff;		\
+			tmp[count[pass][d]++] = arr[i];			\
+		}							\
+		swap = arr;						\
+		arr = tmp;						\
+		tmp = swap;						\
+	}								\
+	return arr;							\
+}
+
+/*
+ * Index of the first of @n elements with a key >= @key.
+ * Branchless bisection: the loop runs exactly log2(n) times, and the
+ * comparison result is used arithmetically rather than for a jump.
+ * Both candidates for the next step are prefetched.
+ */
+#define KEY_SEARCH(NAME, TYPE, MEMB)					\
+long NAME(const TYPE *arr, size_t n, uint64_t key)			\
+{									\
+	const TYPE *base = arr;						\
+	size_t half;							\
+									\
+	if (n == 0)							\
+		return 0;						\
+	while (n > 1) {							\
+		half = n / 2;						\
+		__builtin_prefetch(&base[half / 2]);			\
+		__builtin_prefetch(&base[half + half / 2]);		\
+		base += (base[half - 1]MEMB < key) * half;		\
+		n -= half;						\
+	}								\
+	return (base - arr) + (base[0]MEMB < key);			\
+}
+
+#endif
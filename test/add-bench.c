@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2021 Martin Wilck, SUSE LLC
+ * SPDX-License-Identifier: GPL-2.0-or-newer
+ */
+#include "bench.h"
+
+/*
+ * Measure the registration throughput of event_add() and event_remove()
+ * one by one, compared to event_add_many() and event_remove_many(), for
+ * different numbers of events and timeout stores. All events are timers
+ * with random timeouts far in the future.
+ */
+
+#define DEF_MAX_EVENTS 100000
+
+static int max_events = DEF_MAX_EVENTS;
+
+static const struct {
+	const char *name;
+	unsigned int flags;
+} stores[] = {
+	{ "sorted", DSP_TMO_SORTED, },
+	{ "heap", DSP_TMO_HEAP, },
+	{ "wheel", DSP_TMO_WHEEL, },
+};
+
+/* random relative timeout between 1000 and 2000s */
+static void random_tmo(struct timespec *ts)
+{
+	ts->tv_sec = 1000 + random() % 1000;
+	ts->tv_nsec = random() % 1000000000L;
+}
+
+static void init_events(struct event *evts, const struct timespec *tmos,
+			int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		evts[i] = EVENT_ON_STACK(dummy_cb, -1, 0);
+		evts[i].tmo = tmos[i];
+	}
+}
+
+static int bench(const char *name, unsigned int flags, int n)
+{
+	struct dispatcher *dsp;
+	struct event *evts, **pevts = NULL;
+	struct timespec *tmos = NULL, start;
+	double t_add, t_many, t_remove, t_rm_many;
+	int i, rc = -ENOMEM;
+
+	if ((evts = calloc(n, sizeof(*evts))) == NULL)
+		return -ENOMEM;
+	if ((pevts = calloc(n, sizeof(*pevts))) == NULL ||
+	    (tmos = calloc(n, sizeof(*tmos))) == NULL ||
+	    (dsp = new_dispatcher_ext(CLOCK_MONOTONIC, flags)) == NULL) {
+		free(tmos);
+		free(pevts);
+		free(evts);
+		return -ENOMEM;
+	}
+	for (i = 0; i < n; i++) {
+		random_tmo(&tmos[i]);
+		pevts[i] = &evts[i];
+	}
+
+	init_events(evts, tmos, n);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++) {
+		if ((rc = event_add(dsp, &evts[i])) < 0) {
+			msg(LOG_ERR, "event_add: %s\n", strerror(-rc));
+			goto out;
+		}
+	}
+	t_add = elapsed_ns(&start) / n;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++) {
+		if ((rc = event_remove(&evts[i])) < 0) {
+			msg(LOG_ERR, "event_remove: %s\n", strerror(-rc));
+			goto out;
+		}
+	}
+	t_remove = elapsed_ns(&start) / n;
+
+	init_events(evts, tmos, n);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if ((rc = event_add_many(dsp, pevts, n)) < 0) {
+		msg(LOG_ERR, "event_add_many: %s\n", strerror(-rc));
+		goto out;
+	}
+	t_many = elapsed_ns(&start) / n;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if ((rc = event_remove_many(dsp, pevts, n)) < 0) {
+		msg(LOG_ERR, "event_remove_many: %s\n", strerror(-rc));
+		goto out;
+	}
+	t_rm_many = elapsed_ns(&start) / n;
+
+	printf("%-8s %10d %12.1f %12.1f %12.1f %12.1f\n",
+	       name, n, t_add, t_many, t_remove, t_rm_many);
+out:
+	free_dispatcher(dsp);
+	free(tmos);
+	free(pevts);
+	free(evts);
+	return rc;
+}
+
+static const struct bench_option options[] = {
+	{ 'n', "max-events", "<n>", "max number of events",
+	  &max_events, NULL, },
+	{ 0, },
+};
+
+static const char footer[] = "Stores: sorted, heap, wheel (default: all)\n";
+
+int main(int argc, char *const argv[])
+{
+	unsigned int s;
+	int n;
+
+	if (bench_init(argc, argv, options, "[store...]", footer) != 0)
+		return 1;
+
+	printf("%-8s %10s %12s %12s %12s %12s\n", "store", "#events",
+	       "add/ns", "add_many/ns", "remove/ns", "rm_many/ns");
+	for (s = 0; s < sizeof(stores) / sizeof(*stores); s++) {
+		if (!selected(stores[s].name, argc, argv))
+			continue;
+		for (n = 10; n <= max_events; n *= 10)
+			if (bench(stores[s].name, stores[s].flags, n) < 0)
+				return 1;
+	}
+	return 0;
+}
@@ -235,6 +235,29 @@ static void test_arr_9(ZZZ)
 	check_count(N_ADD / 3);
 }
 
+/* Compaction of the slot array must keep handles of moved events valid */
+static void test_arr_10(ZZZ)
+{
+	int i, n = 0;
+
+	for (i = 0; i < 2 * N_ADD; i++)
+		assert_int_equal(event_add(dsp, &events[i]), 0);
+	for (i = 0; i < 2 * N_ADD; i++)
+		if (i % 8)
+			assert_int_equal(event_remove(&events[i]), 0);
+	for (i = 0; i < 2 * N_ADD; i += 8)
+		assert_int_equal(event_add(dsp, &events[i]), -EEXIST);
+	for (i = 0; i < 2 * N_ADD; i += 8) {
+		if (i % 16)
+			n++;
+		else
+			assert_int_equal(event_remove(&events[i]), 0);
+	}
+
+	cleanup_dispatcher(dsp);
+	check_count(n);
+}
+
 static void test_rnd_0(ZZZ)
 {
 	int i, n;
@@ -359,6 +382,7 @@ static int test_event_array(void)
 		cmocka_unit_test(test_arr_7),
 		cmocka_unit_test(test_arr_8),
 		cmocka_unit_test(test_arr_9),
+		cmocka_unit_test(test_arr_10),
 		cmocka_unit_test(test_rnd_0),
 		cmocka_unit_test(test_rnd_1),
 		cmocka_unit_test(test_rnd_2),
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2021 Martin Wilck, SUSE LLC
+ * SPDX-License-Identifier: GPL-2.0-or-newer
+ */
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+#include "bench.h"
+
+/*
+ * Measure the cost of draining bursts of ready file descriptors with
+ * different epoll batch sizes (see dispatcher_set_batch_size()). In every
+ * round, all eventfds are made readable at once, and event_wait() is
+ * called until every callback has run. Every event_wait() call makes
+ * one epoll_pwait() system call.
+ */
+
+#define DEF_MAX_FDS 10000
+#define DEF_ROUNDS 100
+
+static int max_fds = DEF_MAX_FDS;
+static int rounds = DEF_ROUNDS;
+static int n_received;
+
+static const struct {
+	const char *name;
+	unsigned int min, max;
+} modes[] = {
+	{ "8", 8, 8, },
+	{ "64", 64, 64, },
+	{ "1024", 1024, 1024, },
+	{ "adaptive", 8, 4096, },
+};
+
+static int read_cb(struct event *evt, uint32_t events __attribute__((unused)))
+{
+	uint64_t val;
+
+	if (read(evt->fd, &val, sizeof(val)) == sizeof(val))
+		n_received++;
+	return EVENTCB_CONTINUE;
+}
+
+static int bench(const char *name, unsigned int min, unsigned int max, int n)
+{
+	static const uint64_t one = 1;
+	struct dispatcher *dsp;
+	struct event *evts;
+	struct timespec start;
+	unsigned long n_waits = 0;
+	double t_total = 0;
+	int i, r, rc = 0;
+
+	if ((evts = calloc(n, sizeof(*evts))) == NULL)
+		return -ENOMEM;
+	for (i = 0; i < n; i++)
+		evts[i].fd = -1;
+	if ((dsp = new_dispatcher(CLOCK_MONOTONIC)) == NULL) {
+		free(evts);
+		return -ENOMEM;
+	}
+	if ((rc = dispatcher_set_batch_size(dsp, min, max)) < 0) {
+		msg(LOG_ERR, "dispatcher_set_batch_size: %s\n", strerror(-rc));
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		int fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+
+		if (fd == -1) {
+			rc = -errno;
+			msg(LOG_ERR, "eventfd: %m\n");
+			goto out;
+		}
+		evts[i] = EVENT_ON_STACK(read_cb, fd, EPOLLIN);
+		if ((rc = event_add(dsp, &evts[i])) < 0) {
+			msg(LOG_ERR, "event_add: %s\n", strerror(-rc));
+			goto out;
+		}
+	}
+
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < n; i++)
+			if (write(evts[i].fd, &one, sizeof(one)) != sizeof(one)) {
+				rc = -errno;
+				msg(LOG_ERR, "write: %m\n");
+				goto out;
+			}
+		n_received = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		while (n_received < n) {
+			if ((rc = event_wait(dsp, NULL)) < 0) {
+				msg(LOG_ERR, "event_wait: %s\n", strerror(-rc));
+				goto out;
+			}
+			n_waits++;
+		}
+		t_total += elapsed_ns(&start);
+	}
+	rc = 0;
+
+	printf("%-10s %8d %14.4f %12.1f\n", name, n,
+	       (double)n_waits / ((double)n * rounds), t_total / n / rounds);
+out:
+	free_dispatcher(dsp);
+	for (i = 0; i < n; i++)
+		if (evts[i].fd != -1)
+			close(evts[i].fd);
+	free(evts);
+	return rc;
+}
+
+/* We need max_fds file descriptors, plus a few for the dispatcher */
+static void raise_fd_limit(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1 ||
+	    rl.rlim_cur >= (rlim_t)max_fds + 16)
+		return;
+	rl.rlim_cur = (rlim_t)max_fds + 16;
+	if (rl.rlim_max != RLIM_INFINITY && rl.rlim_cur > rl.rlim_max)
+		rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+		msg(LOG_WARNING, "setrlimit: %m\n");
+}
+
+static const struct bench_option options[] = {
+	{ 'n', "max-fds", "<n>", "max number of eventfds", &max_fds, NULL, },
+	{ 'r', "rounds", "<n>", "bursts per measurement", &rounds, NULL, },
+	{ 0, },
+};
+
+static const char footer[] =
+	"Modes: 8, 64, 1024 (fixed batch size), adaptive (default: all)\n";
+
+int main(int argc, char *const argv[])
+{
+	unsigned int m;
+	int n;
+
+	if (bench_init(argc, argv, options, "[mode...]", footer) != 0)
+		return 1;
+	raise_fd_limit();
+
+	printf("%-10s %8s %14s %12s\n", "batch", "#fds", "waits/event",
+	       "event/ns");
+	for (m = 0; m < sizeof(modes) / sizeof(*modes); m++) {
+		if (!selected(modes[m].name, argc, argv))
+			continue;
+		for (n = 10; n <= max_fds; n *= 10)
+			if (bench(modes[m].name, modes[m].min, modes[m].max,
+				  n) < 0)
+				return 1;
+	}
+	return 0;
+}
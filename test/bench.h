@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2021 Martin Wilck, SUSE LLC
+ * SPDX-License-Identifier: GPL-2.0-or-newer
+ */
+#ifndef _BENCH_H
+#define _BENCH_H
+
+/*
+ * Helpers shared by the benchmark programs: timing, option parsing, and
+ * selecting variants by name on the command line.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <syslog.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "log.h"
+#include "../ts-util.h"
+#include "../event.h"
+
+/* Maximum number of options of a benchmark, without -h */
+#define BENCH_MAX_OPTS 15
+
+/**
+ * struct bench_option - command line option of a benchmark
+ * @opt: short option character
+ * @name: long option name
+ * @arg: name of the argument in the help text, NULL for flags
+ * @help: description of the option
+ * @val: for options with argument, receives the value, which must be
+ *       a positive integer. The initial value is shown as default.
+ * @set: if non-NULL, set to true if the option was given
+ *
+ * Arrays of options are terminated by an element with @opt == 0, and
+ * can have at most BENCH_MAX_OPTS elements before it.
+ */
+struct bench_option {
+	int opt;
+	const char *name;
+	const char *arg;
+	const char *help;
+	int *val;
+	bool *set;
+};
+
+static __attribute__((unused))
+int dummy_cb(struct event *evt __attribute__((unused)),
+	     uint32_t events __attribute__((unused)))
+{
+	return EVENTCB_CONTINUE;
+}
+
+/* Nanoseconds of CLOCK_MONOTONIC since @start */
+static __attribute__((unused))
+double elapsed_ns(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ts_subtract(&now, start);
+	return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+static int read_int(const char *arg, const char *opt, int *val)
+{
+	int v;
+	char dummy;
+
+	if (sscanf(arg, "%d%c", &v, &dummy) == 1 && v > 0) {
+		*val = v;
+		return 0;
+	} else {
+		msg(LOG_ERR, "--%s: ignoring invalid argument \"%s\"\n",
+		    opt, arg);
+		return -EINVAL;
+	}
+}
+
+static void usage(const char *prog, const struct bench_option *opts,
+		  const int *defaults, const char *args, const char *footer)
+{
+	char buf[64];
+	int i;
+
+	fprintf(stderr, "Usage: %s [options]%s%s\nOptions:\n",
+		prog, args ? " " : "", args ? args : "");
+	for (i = 0; opts[i].opt; i++) {
+		snprintf(buf, sizeof(buf), "[-%c|--%s]%s%s", opts[i].opt,
+			 opts[i].name, opts[i].arg ? " " : "",
+			 opts[i].arg ? opts[i].arg : "");
+		fprintf(stderr, "\t%-24s %s", buf, opts[i].help);
+		if (opts[i].val)
+			fprintf(stderr, " (default: %d)", defaults[i]);
+		fprintf(stderr, "\n");
+	}
+	fprintf(stderr, "\t%-24s %s\n", "[-h|--help]", "print this help");
+	if (footer)
+		fputs(footer, stderr);
+}
+
+/**
+ * bench_init() - set up logging and parse the command line
+ * @argc, @argv: arguments of main()
+ * @opts: options of the benchmark, terminated by an element with @opt == 0
+ * @args: description of non-option arguments for the help text, or NULL
+ * @footer: additional help text, or NULL
+ *
+ * Non-option arguments start at @optind when this function returns.
+ * Exits if -h is given.
+ *
+ * Return: 0 on success, -EINVAL for invalid options.
+ */
+static __attribute__((unused))
+int bench_init(int argc, char *const argv[], const struct bench_option *opts,
+	       const char *args, const char *footer)
+{
+	struct option longopts[BENCH_MAX_OPTS + 2];
+	char optstring[2 * BENCH_MAX_OPTS + 2], *p = optstring;
+	int defaults[BENCH_MAX_OPTS];
+	int n, i, opt;
+
+	log_level = LOG_WARNING;
+	for (n = 0; opts[n].opt; n++);
+	if (n > BENCH_MAX_OPTS)
+		return -EINVAL;
+
+	for (i = 0; i < n; i++) {
+		longopts[i] = (struct option){
+			.name = opts[i].name,
+			.has_arg = opts[i].arg ?
+				required_argument : no_argument,
+			.val = opts[i].opt,
+		};
+		*p++ = opts[i].opt;
+		if (opts[i].arg)
+			*p++ = ':';
+		defaults[i] = opts[i].val ? *opts[i].val : 0;
+	}
+	longopts[n] = (struct option){ .name = "help", .val = 'h', };
+	longopts[n + 1] = (struct option){ 0, };
+	*p++ = 'h';
+	*p = '\0';
+
+	while ((opt = getopt_long(argc, argv, optstring,
+				  longopts, NULL)) != -1) {
+		if (opt == 'h') {
+			usage(argv[0], opts, defaults, args, footer);
+			exit(0);
+		}
+		for (i = 0; i < n && opts[i].opt != opt; i++);
+		if (i == n) {
+			usage(argv[0], opts, defaults, args, footer);
+			return -EINVAL;
+		}
+		if (opts[i].val &&
+		    read_int(optarg, longopts[i].name, opts[i].val) != 0)
+			continue;
+		if (opts[i].set)
+			*opts[i].set = true;
+	}
+	return 0;
+}
+
+/* Is @name given as non-option argument? Without such arguments, all are */
+static __attribute__((unused))
+bool selected(const char *name, int argc, char *const argv[])
+{
+	int i;
+
+	if (optind == argc)
+		return true;
+	for (i = optind; i < argc; i++)
+		if (!strcmp(argv[i], name))
+			return true;
+	return false;
+}
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2021 Martin Wilck, SUSE LLC
+ * SPDX-License-Identifier: GPL-2.0-or-newer
+ */
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "bench.h"
+
+/*
+ * Measure the lateness of timeouts while the dispatcher is saturated
+ * with I/O: a number of eventfds are permanently readable, and every
+ * callback for them burns some CPU time. Periodic timers run alongside.
+ */
+
+#define DEF_N_FDS 32
+#define DEF_N_TIMERS 100
+#define DEF_WORK_US 5
+#define DEF_INTERVAL_US 1000
+#define DEF_RUNTIME 2
+
+static int n_fds = DEF_N_FDS;
+static int n_timers = DEF_N_TIMERS;
+static int work_us = DEF_WORK_US;
+static int interval_us = DEF_INTERVAL_US;
+static int runtime = DEF_RUNTIME;
+static bool no_timerfd;
+static unsigned int dsp_flags;
+static unsigned long n_io;
+
+static void busy_wait(int us)
+{
+	struct timespec start, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ts_subtract(&now, &start);
+	} while (now.tv_sec == 0 && now.tv_nsec < us * 1000L);
+}
+
+static int io_cb(struct event *evt __attribute__((unused)),
+		 uint32_t events __attribute__((unused)))
+{
+	n_io++;
+	busy_wait(work_us);
+	return EVENTCB_CONTINUE;
+}
+
+static int tick_cb(struct event *evt __attribute__((unused)),
+		   uint32_t events __attribute__((unused)))
+{
+	return EVENTCB_CONTINUE;
+}
+
+static int bench(void)
+{
+	struct dispatcher *dsp;
+	struct event *evts;
+	struct timespec start, now;
+	struct timeout_stats st;
+	unsigned long long p99 = 0;
+	int i, rc = 0;
+
+	if ((evts = calloc(n_fds + n_timers, sizeof(*evts))) == NULL)
+		return -ENOMEM;
+	if ((dsp = new_dispatcher_ext(CLOCK_MONOTONIC, dsp_flags)) == NULL) {
+		free(evts);
+		return -ENOMEM;
+	}
+	if ((rc = dispatcher_set_histograms(dsp, true)) < 0) {
+		msg(LOG_ERR, "dispatcher_set_histograms: %s\n", strerror(-rc));
+		goto out;
+	}
+
+	for (i = 0; i < n_fds; i++) {
+		int fd = eventfd(1, EFD_NONBLOCK|EFD_CLOEXEC);
+
+		if (fd == -1) {
+			rc = -errno;
+			msg(LOG_ERR, "eventfd: %m\n");
+			goto out;
+		}
+		evts[i] = EVENT_ON_STACK(io_cb, fd, EPOLLIN);
+		if ((rc = event_add(dsp, &evts[i])) < 0) {
+			close(fd);
+			msg(LOG_ERR, "event_add: %s\n", strerror(-rc));
+			goto out;
+		}
+	}
+	for (i = n_fds; i < n_fds + n_timers; i++) {
+		evts[i] = PERIODIC_TIMER_EVENT_ON_STACK(tick_cb, interval_us);
+		if ((rc = event_add(dsp, &evts[i])) < 0) {
+			msg(LOG_ERR, "event_add: %s\n", strerror(-rc));
+			goto out;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		if ((rc = event_wait(dsp, NULL)) < 0) {
+			msg(LOG_ERR, "event_wait: %s\n", strerror(-rc));
+			goto out;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ts_subtract(&now, &start);
+	} while (now.tv_sec < runtime);
+
+	dispatcher_get_timeout_stats(dsp, &st);
+	dispatcher_get_percentile(dsp, DSP_HIST_LATENESS, 99, &p99);
+	printf("%8d %8d %8d %12lu %12llu %12llu %12.1f %12.1f %12.1f\n",
+	       n_fds, n_timers, work_us, n_io, st.expired, st.missed_ticks,
+	       st.expired ? st.total_lateness_ns / 1e3 / st.expired : 0,
+	       p99 / 1e3, st.max_lateness_ns / 1e3);
+out:
+	free_dispatcher(dsp);
+	free(evts);
+	return rc;
+}
+
+static const struct bench_option options[] = {
+	{ 'n', "n-fds", "<n>", "number of busy fds", &n_fds, NULL, },
+	{ 'm', "n-timers", "<n>", "number of periodic timers",
+	  &n_timers, NULL, },
+	{ 'w', "work", "<us>", "CPU time per I/O callback", &work_us, NULL, },
+	{ 'i', "interval", "<us>", "timer interval", &interval_us, NULL, },
+	{ 't', "runtime", "<s>", "runtime", &runtime, NULL, },
+	{ 'T', "no-timerfd", NULL, "use DSP_NO_TIMERFD", NULL, &no_timerfd, },
+	{ 0, },
+};
+
+int main(int argc, char *const argv[])
+{
+	if (bench_init(argc, argv, options, NULL, NULL) != 0)
+		return 1;
+	if (no_timerfd)
+		dsp_flags |= DSP_NO_TIMERFD;
+
+	printf("%8s %8s %8s %12s %12s %12s %12s %12s %12s\n", "#fds",
+	       "#timers", "work/us", "#io", "#expired", "#missed", "late/us",
+	       "p99/us", "max/us");
+	return bench() < 0 ? 1 : 0;
+}
@@ -156,7 +156,7 @@ static int clt_cb(struct event *evt, uint32_t events)
 		int n;
 		n = snprintf(buf, sizeof(buf),
 			     "Hello, this is %ld", (long)clt->pid);
-		clock_gettime(CLOCK_REALTIME, &clt->start);
+		dispatcher_now(evt->dsp, &clt->start);
 		if ((rc = sendto(evt->fd, buf, n + 1, 0,
 				 (const struct sockaddr *)&minivent_sa,
 				 sizeof(minivent_sa))) != n + 1) {
@@ -174,7 +174,7 @@ static int clt_cb(struct event *evt, uint32_t events)
 			msg(LOG_ERR, "read: %d (%m)\n", rc);
 			stop_client(clt);
 		}
-		clock_gettime(CLOCK_REALTIME, &now);
+		dispatcher_now(evt->dsp, &now);
 		ts_subtract(&now, &clt->start);
 
 		buf[rc == sizeof(buf) ? rc - 1 : rc] = '\0';
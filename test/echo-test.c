@@ -155,7 +155,7 @@ static int clt_cb(struct event *evt, uint32_t events)
 	} else if (events & EPOLLOUT) {
 		int n;
 
-		clock_gettime(CLOCK_REALTIME, &clt->start);
+		dispatcher_now(evt->dsp, &clt->start);
 		n = snprintf(buf, sizeof(buf),
 			     "Hello, this is %ld", (long)clt->pid);
 		if ((rc = write(evt->fd, buf, n + 1)) != n + 1) {
@@ -173,7 +173,7 @@ static int clt_cb(struct event *evt, uint32_t events)
 			msg(LOG_ERR, "read: %d (%m)\n", rc);
 			stop_client(clt);
 		}
-		clock_gettime(CLOCK_REALTIME, &now);
+		dispatcher_now(evt->dsp, &now);
 		ts_subtract(&now, &clt->start);
 
 		buf[rc == sizeof(buf) ? rc - 1 : rc] = '\0';
@@ -313,12 +313,14 @@ static int start_clients(struct dispatcher *dsp)
 }
 
 static bool must_close;
+/* timeout classes for the server's connections */
+static unsigned int recv_class, send_class;
 
 static int conn_cb(struct event *ev, uint32_t events)
 {
 	struct echo_event *echo = container_of(ev, struct echo_event, e);
 	int rc;
-	const struct timespec *new_tmo;
+	unsigned int new_class;
 
 	if (ev->reason == REASON_TIMEOUT) {
 		msg(LOG_WARNING, "timeout\n");
@@ -336,7 +338,7 @@ static int conn_cb(struct event *ev, uint32_t events)
 			return EVENTCB_CLEANUP;
 		}
 		ev->ep.events = EPOLLOUT|EPOLLHUP;
-		new_tmo = &send_tmo;
+		new_class = send_class;
 	} else {
 		rc = write(ev->fd, echo->buf,
 			   strnlen(echo->buf, sizeof(echo->buf)));
@@ -345,7 +347,7 @@ static int conn_cb(struct event *ev, uint32_t events)
 			return EVENTCB_CLEANUP;
 		}
 		ev->ep.events = EPOLLIN|EPOLLHUP;
-		new_tmo = &recv_tmo;
+		new_class = recv_class;
 	}
 
 	if ((rc = event_modify(ev)) < 0) {
@@ -353,8 +355,8 @@ static int conn_cb(struct event *ev, uint32_t events)
 		return EVENTCB_CLEANUP;
 	}
 
-	if ((rc = event_mod_timeout(ev, new_tmo)) < 0) {
-		msg(LOG_ERR, "event_mod_timeout: %s\n", strerror(-rc));
+	if ((rc = event_mod_tmo_class(ev, new_class)) < 0) {
+		msg(LOG_ERR, "event_mod_tmo_class: %s\n", strerror(-rc));
 		return EVENTCB_CLEANUP;
 	}
 
@@ -394,6 +396,7 @@ static int accept_cb(struct event *ev, uint32_t events __attribute__((unused)))
 
 	conn_event->e = EVENT_W_TMO_ON_HEAP(conn_cb, cfd, EPOLLIN|EPOLLHUP,
 					    RECV_TMO_SECS * 1000000);
+	conn_event->e.tmo_class = recv_class;
 
 	if ((rc = event_add(ev->dsp, &conn_event->e)) < 0) {
 		msg(LOG_ERR, "event_add: %s\n", strerror(-rc));
@@ -471,6 +474,13 @@ static int server(void)
 		return errno ? -errno : -1;
 	}
 
+	if ((rc = dispatcher_add_tmo_class(dsp, &recv_tmo)) < 0)
+		return rc;
+	recv_class = rc;
+	if ((rc = dispatcher_add_tmo_class(dsp, &send_tmo)) < 0)
+		return rc;
+	send_class = rc;
+
 	if ((rc = start_clients(dsp)) < 0)
 		return -1;
 
@@ -38,6 +38,10 @@ static int avg_threshold = DEF_THRESH;
 
 static bool stop_signal;
 
+/* DSP_xxx flags for new_dispatcher_ext() */
+static unsigned int dsp_flags;
+static bool add_many;
+
 /*
  * interval: 1, 2, 3, or 4 s
  * start value 0.5, 0.6, 0.7, ..., 0.9s
@@ -202,7 +206,7 @@ static int test_cb(struct event *evt, uint32_t __attribute__((unused)) events)
 	uint64_t val;
 	struct timespec new_tmo = { .tv_sec = 0, };
 	struct itevent *itev = (struct itevent *)evt;
-	struct timespec now;
+	struct timespec now, fd_now, tmo_exp;
 	static const struct timespec null_ts;
 	struct itimerspec cur;
 	double dev;
@@ -245,7 +249,9 @@ static int test_cb(struct event *evt, uint32_t __attribute__((unused)) events)
 
 check_timer:
 
-	clock_gettime(dispatcher_get_clocksource(evt->dsp), &now);
+	/* Relative timeouts are based on the dispatcher's cached time */
+	dispatcher_now(evt->dsp, &now);
+	clock_gettime(dispatcher_get_clocksource(evt->dsp), &fd_now);
 	if (timerfd_gettime(evt->fd, &cur) == -1) {
 		msg(LOG_ERR, "timerfd_gettime: %m\n");
 		itev->err_count++;
@@ -302,28 +308,18 @@ check_timer:
 		new_tmo.tv_sec++;
 	}
 
-	if (!(evt->flags & TMO_ABS)) {
-		itev->expected = now;
-		if (ts_compare(&new_tmo, &null_ts) == 0 ||
-		    (!itev->disabled &&
-		     ts_compare(&cur.it_value, &new_tmo) <= 0)) {
-			ts_add(&itev->expected, &cur.it_value);
-			itev->expect = REASON_EVENT_OCCURED;
-		} else {
-			ts_add(&itev->expected, &new_tmo);
-			itev->expect = REASON_TIMEOUT;
-		}
+	/* The timerfd's remaining time is relative to the current time */
+	ts_add(&cur.it_value, &fd_now);
+	tmo_exp = new_tmo;
+	if (!(evt->flags & TMO_ABS))
+		ts_add(&tmo_exp, &now);
+	if (ts_compare(&new_tmo, &null_ts) == 0 ||
+	    (!itev->disabled && ts_compare(&cur.it_value, &tmo_exp) <= 0)) {
+		itev->expected = cur.it_value;
+		itev->expect = REASON_EVENT_OCCURED;
 	} else {
-		ts_add(&cur.it_value, &now);
-		if (ts_compare(&new_tmo, &null_ts) == 0 ||
-		    (!itev->disabled &&
-		     ts_compare(&cur.it_value, &new_tmo) <= 0)) {
-			itev->expected = cur.it_value;
-			itev->expect = REASON_EVENT_OCCURED;
-		} else {
-			itev->expected = new_tmo;
-			itev->expect = REASON_TIMEOUT;
-		}
+		itev->expected = tmo_exp;
+		itev->expect = REASON_TIMEOUT;
 	}
 	msg(LOG_INFO, "%d: expecting %s @%s (ev %s tmo %s)\n",
 	    itev->instance, reason_str[itev->expect],
@@ -386,7 +382,7 @@ static int do_test(const char *name,
 	if ((evt = calloc(n_events + 1, sizeof(*evt))) == NULL)
 		return -ENOMEM;
 
-	dsp = new_dispatcher(LOG_CLOCK);
+	dsp = new_dispatcher_ext(LOG_CLOCK, dsp_flags);
 	if (!dsp) {
 		msg(LOG_ERR, "failed to create dispatcher: %m\n");
 		return -errno;
@@ -429,9 +425,20 @@ static int do_test(const char *name,
 		    format_ts(&it.it_interval, tb1, sizeof(tb1)));
 	}
 
-	for (i = 0; i < n_events; i++) {
-		if (event_add(dsp, evt[i]) != 0)
-			msg(LOG_ERR, "failed to add event %d: %m\n", i);
+	if (add_many) {
+		int n;
+
+		/* skip the events whose timerfd couldn't be set up */
+		for (i = 0, n = 0; i < n_events; i++)
+			if (evt[i])
+				evt[n++] = evt[i];
+		if ((rc = event_add_many(dsp, evt, n)) != 0)
+			msg(LOG_ERR, "failed to add events: %s\n", strerror(-rc));
+	} else {
+		for (i = 0; i < n_events; i++) {
+			if (event_add(dsp, evt[i]) != 0)
+				msg(LOG_ERR, "failed to add event %d: %m\n", i);
+		}
 	}
 
 	set_wait_mask(&ep_mask);
@@ -487,6 +494,262 @@ static int do_test(const char *name,
 	return rc;
 }
 
+/*
+ * Periodic timers
+ * interval: 25, 50, 75, or 100ms, 50ms for event 0
+ * start value 10, 20, ..., 50ms
+ */
+static void start_periodic(int i, struct itimerspec *it,
+			   unsigned short *flags __attribute__((unused)))
+{
+	it->it_value.tv_sec = 0;
+	it->it_value.tv_nsec = (random() % 5 + 1) * 10 * 1000 * 1000L;
+	it->it_interval.tv_sec = 0;
+	it->it_interval.tv_nsec = (i == 0 ? 2 : random() % 4 + 1) *
+		25 * 1000 * 1000L;
+}
+
+static uint64_t ts_to_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+/* Event 0 blocks in every 10th callback, for 2.5 intervals */
+#define PT_BLOCK_EVERY 10
+
+struct ptevent {
+	struct event e;
+	int instance;
+	int count;
+	int missed;
+	int err_count;
+	uint64_t first;
+	uint64_t periods;
+	bool blocked;
+};
+
+static int periodic_cb(struct event *evt,
+		       uint32_t events __attribute__((unused)))
+{
+	struct ptevent *ptev = (struct ptevent *)evt;
+	uint64_t iv = ts_to_ns(&evt->tmo_interval);
+	uint64_t tmo = ts_to_ns(&evt->tmo), due, late, until;
+	unsigned int missed;
+	struct timespec now, ts;
+
+	if (evt->reason != REASON_TIMEOUT) {
+		msg(LOG_ERR, "%d: unexpected reason %s\n",
+		    ptev->instance, reason_str[evt->reason]);
+		ptev->err_count++;
+		return EVENTCB_CONTINUE;
+	}
+
+	/* Expiry is determined with the time cached at wakeup */
+	dispatcher_now(evt->dsp, &now);
+	if (ptev->count == 0)
+		ptev->first = tmo;
+
+	/* The deadline must be a multiple of the interval after the first */
+	due = ptev->first + ptev->periods * iv;
+	if (tmo != due) {
+		msg(LOG_ERR, "%d DRIFT @%d: deadline %" PRIu64 " != %" PRIu64 "\n",
+		    ptev->instance, ptev->count, tmo, due);
+		ptev->err_count++;
+	}
+
+	if (ts_to_ns(&now) < tmo) {
+		msg(LOG_ERR, "%d EARLY EVENT %d\n", ptev->instance, ptev->count);
+		ptev->err_count++;
+		late = 0;
+	} else
+		late = ts_to_ns(&now) - tmo;
+
+	/* Every full interval of lateness skips a period */
+	missed = late / iv;
+	if (evt->tmo_missed != missed || (ptev->blocked && missed != 1)) {
+		msg(LOG_ERR, "%d MISSED @%d: %u != %u%s\n",
+		    ptev->instance, ptev->count, evt->tmo_missed, missed,
+		    ptev->blocked ? " after blocking" : "");
+		ptev->err_count++;
+	}
+
+	ptev->count++;
+	ptev->missed += evt->tmo_missed;
+	ptev->periods += evt->tmo_missed + 1;
+	ptev->blocked = false;
+
+	if (ptev->instance == 0 && ptev->count % PT_BLOCK_EVERY == 0) {
+		/* The next deadline expires 1.5 intervals before we return */
+		until = tmo + 5 * iv / 2;
+		ts.tv_sec = until / 1000000000ULL;
+		ts.tv_nsec = until % 1000000000ULL;
+		while (clock_nanosleep(LOG_CLOCK, TIMER_ABSTIME, &ts, NULL) == EINTR);
+		ptev->blocked = true;
+	}
+	return EVENTCB_CONTINUE;
+}
+
+static void cleanup_ptevent(struct ptevent **pt)
+{
+	free(*pt);
+}
+
+/*
+ * Native periodic timers must not drift, and must report the periods
+ * which were skipped because a callback blocked the dispatcher.
+ */
+static int do_periodic_test(const char *name,
+			    void (*start_times)(int i, struct itimerspec *,
+						unsigned short *))
+{
+	struct ptevent *ptev __attribute__((cleanup(cleanup_ptevent))) = NULL;
+	struct event **evt __attribute__((cleanup(cleanup_event))) = NULL;
+	struct dispatcher *dsp __attribute__((cleanup(free_dsp))) = NULL;
+	struct event ev_stop;
+	sigset_t ep_mask;
+	int i, rc;
+	int total_count = 0, missed_count = 0, err_count = 0;
+	char tb0[24], tb1[24];
+	struct timespec start_ts;
+
+	if ((ptev = calloc(n_events, sizeof(*ptev))) == NULL)
+		return -ENOMEM;
+	if ((evt = calloc(n_events, sizeof(*evt))) == NULL)
+		return -ENOMEM;
+
+	dsp = new_dispatcher_ext(LOG_CLOCK, dsp_flags);
+	if (!dsp) {
+		msg(LOG_ERR, "failed to create dispatcher: %m\n");
+		return -errno;
+	}
+
+	for (i = 0; i < n_events; i++) {
+		struct itimerspec it = {0, };
+
+		start_times(i, &it, &ptev[i].e.flags);
+		ptev[i].e = PERIODIC_TIMER_EVENT_ON_STACK(periodic_cb,
+						ts_to_us(&it.it_interval));
+		ptev[i].e.tmo = it.it_value;
+		ptev[i].instance = i;
+		evt[i] = &ptev[i].e;
+		msg(LOG_INFO, "event %d: start %s, interval %s\n",
+		    ptev[i].instance,
+		    format_ts(&it.it_value, tb0, sizeof(tb0)),
+		    format_ts(&it.it_interval, tb1, sizeof(tb1)));
+	}
+
+	if (add_many) {
+		if ((rc = event_add_many(dsp, evt, n_events)) != 0)
+			msg(LOG_ERR, "failed to add events: %s\n", strerror(-rc));
+	} else {
+		for (i = 0; i < n_events; i++) {
+			if (event_add(dsp, evt[i]) != 0)
+				msg(LOG_ERR, "failed to add event %d: %m\n", i);
+		}
+	}
+
+	set_wait_mask(&ep_mask);
+
+	if (!stop_signal) {
+		ev_stop = TIMER_EVENT_ON_STACK(fini_cb, runtime * 1000000);
+		if (event_add(dsp, &ev_stop))
+			msg(LOG_ERR, "failed to add stop event: %m\n");
+	} else {
+		sigdelset(&ep_mask, SIGALRM);
+		alarm(runtime);
+	}
+
+	clock_gettime(LOG_CLOCK, &start_ts);
+	msg(LOG_NOTICE, "%s: started @%s, #events=%d, duration: %ds\n",
+	    name, format_ts(&start_ts, tb0, sizeof(tb0)), n_events, runtime);
+
+	rc = event_loop(dsp, &ep_mask, NULL);
+
+	if (rc != -EINTR || !must_exit) {
+		msg(LOG_WARNING, "unexpected exit from: %s\n", strerror(-rc));
+		return 100;
+	}
+
+	for (i = 0; i < n_events; i++) {
+		msg(LOG_NOTICE, "%d: count=%d missed=%d err=%d\n",
+		    ptev[i].instance, ptev[i].count, ptev[i].missed,
+		    ptev[i].err_count);
+		total_count += ptev[i].count;
+		missed_count += ptev[i].missed;
+		err_count += ptev[i].err_count;
+		event_remove(&ptev[i].e);
+	}
+	printf("%s: count=%d, missed=%d, errors=%d\n",
+	       name, total_count, missed_count, err_count);
+
+	rc = 0;
+	if (err_count > 0) {
+		msg(LOG_ERR, "ERROR: %d errors occured\n", err_count);
+		rc++;
+	}
+	/* Event 0 blocks at least once during the test */
+	if (ptev[0].count > PT_BLOCK_EVERY && ptev[0].missed == 0) {
+		msg(LOG_ERR, "ERROR: no missed periods reported\n");
+		rc++;
+	}
+	return rc;
+}
+
+static struct timespec lazy_fired;
+
+static int lazy_cb(struct event *evt, uint32_t events __attribute__((unused)))
+{
+	clock_gettime(dispatcher_get_clocksource(evt->dsp), &lazy_fired);
+	return EVENTCB_CONTINUE;
+}
+
+/*
+ * Push a TMO_LAZY timeout out before it expires. The dispatcher wakes up
+ * at the old deadline, but must not call the callback before the new one.
+ */
+static int do_lazy_test(void)
+{
+	static const struct timespec null_ts;
+	struct dispatcher *dsp __attribute__((cleanup(free_dsp))) = NULL;
+	struct timespec tmo = { .tv_nsec = 200000000L, }, due, late;
+	struct event evt;
+	char tb0[24];
+	int i, rc;
+
+	dsp = new_dispatcher_ext(LOG_CLOCK, dsp_flags);
+	if (!dsp) {
+		msg(LOG_ERR, "failed to create dispatcher: %m\n");
+		return 1;
+	}
+	evt = TIMER_EVENT_ON_STACK(lazy_cb, 100000);
+	evt.flags |= TMO_LAZY;
+	if ((rc = event_add(dsp, &evt)) < 0) {
+		msg(LOG_ERR, "failed to add lazy timer: %s\n", strerror(-rc));
+		return 1;
+	}
+	usleep(50000);
+	clock_gettime(LOG_CLOCK, &due);
+	ts_add(&due, &tmo);
+	if ((rc = event_mod_timeout(&evt, &tmo)) < 0) {
+		msg(LOG_ERR, "failed to refresh lazy timer: %s\n", strerror(-rc));
+		return 1;
+	}
+
+	lazy_fired = null_ts;
+	for (i = 0; i < 100 && ts_compare(&lazy_fired, &null_ts) == 0; i++)
+		event_wait(dsp, NULL);
+
+	late = lazy_fired;
+	ts_subtract(&late, &due);
+	printf("lazy: fired %s after the new deadline\n",
+	       format_ts(&late, tb0, sizeof(tb0)));
+	if (ts_compare(&lazy_fired, &null_ts) == 0 || late.tv_sec < 0) {
+		msg(LOG_ERR, "ERROR: lazy timeout fired early or not at all\n");
+		return 1;
+	}
+	return 0;
+}
+
 static int read_int(const char *arg, const char *opt, int *val)
 {
 	int v;
@@ -501,6 +764,25 @@ static int read_int(const char *arg, const char *opt, int *val)
 	}
 }
 
+static int read_store(const char *arg)
+{
+	static const char *const stores[] = {
+		[DSP_TMO_SORTED] = "sorted",
+		[DSP_TMO_HEAP] = "heap",
+		[DSP_TMO_WHEEL] = "wheel",
+	};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(stores) / sizeof(*stores); i++) {
+		if (stores[i] && !strcmp(arg, stores[i])) {
+			dsp_flags = (dsp_flags & ~DSP_TMO_MASK) | i;
+			return 0;
+		}
+	}
+	msg(LOG_ERR, "--store: ignoring invalid argument \"%s\"\n", arg);
+	return -EINVAL;
+}
+
 static void usage(const char *prog)
 {
 	fprintf(stderr,
@@ -511,6 +793,9 @@ static void usage(const char *prog)
 		"\t[-m|--max-threshold] <x>	error threshold for max callback delay in us (default: %d)\n"
 		"\t[-a|--avg-threshold] <x>	error threshold for avg callback delay in us (default: %d)\n"
 		"\t[-s|--signal]		use signal rather than event for stopping\n"
+		"\t[-S|--store] <store>	timeout store: sorted, heap, wheel (default: sorted)\n"
+		"\t[-T|--no-timerfd]		wait with epoll_pwait2 timeout instead of timerfd\n"
+		"\t[-M|--add-many]		add the events with event_add_many()\n"
 		"\t|-q|--quiet]			suppress log messages\n"
 		"\t[-v|--verbose]		verbose messages\n"
 		"\t[-d|--debug]			debug messages\n"
@@ -526,13 +811,16 @@ static int check_args(int argc, char *const argv[])
 		{ "max-threshold", 1, NULL, 'm' },
 		{ "avg-threshold", 1, NULL, 'a' },
 		{ "signal", 0, NULL, 's' },
+		{ "store", 1, NULL, 'S' },
+		{ "no-timerfd", 0, NULL, 'T' },
+		{ "add-many", 0, NULL, 'M' },
 		{ "quiet", 0, NULL, 'q' },
 		{ "verbose", 0, NULL, 'v' },
 		{ "debug", 0, NULL, 'd' },
 		{ "help", 0, NULL, 'h' },
 		{ 0, },
 	};
-	static const char optstring[] = "t:n:m:a:sqvdh";
+	static const char optstring[] = "t:n:m:a:sS:TMqvdh";
 	int opt;
 
 	while((opt = getopt_long(argc, argv, optstring, longopts, NULL)) != -1) {
@@ -553,6 +841,15 @@ static int check_args(int argc, char *const argv[])
 		case 's':
 			stop_signal = true;
 			break;
+		case 'S':
+			read_store(optarg);
+			break;
+		case 'T':
+			dsp_flags |= DSP_NO_TIMERFD;
+			break;
+		case 'M':
+			add_many = true;
+			break;
 		case 'q':
 			if (log_level < LOG_INFO)
 				log_level = LOG_WARNING;
@@ -597,5 +894,7 @@ int main(int argc, char *const argv[])
 	rc += do_test("test 1", start_event_1, new_timeout_1, NULL);
 	rc += do_test("test 2", start_event_2, new_timeout_2, disable_2);
 	rc += do_test("test 3", start_event_3, new_timeout_3, disable_2);
+	rc += do_periodic_test("test 4", start_periodic);
+	rc += do_lazy_test();
 	return rc ? 1 : 0;
 }
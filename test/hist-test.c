@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2021 Martin Wilck, SUSE LLC
+ * SPDX-License-Identifier: GPL-2.0-or-newer
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <syslog.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+#include "../histogram.h"
+#include "../event.h"
+
+#define NV 100000
+#define N_TIMERS 20
+
+static struct histogram hist;
+
+/* The percentile may be up to 1/16 above the exact value, never below */
+static int check_percentile(double percent, uint64_t exact)
+{
+	uint64_t val = histogram_percentile(&hist, percent);
+
+	if (val < exact || val > exact + exact / 16) {
+		fprintf(stderr, "p%g: %llu, expected %llu\n", percent,
+			(unsigned long long)val, (unsigned long long)exact);
+		return 1;
+	}
+	return 0;
+}
+
+static int test_small(void)
+{
+	int i, errors = 0;
+
+	histogram_reset(&hist);
+	errors += histogram_percentile(&hist, 50) != 0;
+	/* values below 16 are exact */
+	for (i = 0; i < 16; i++)
+		histogram_add(&hist, i);
+	for (i = 0; i < 16; i++)
+		errors += histogram_percentile(&hist, (i + 1) * 100. / 16) !=
+			(uint64_t)i;
+	return errors;
+}
+
+static int test_uniform(void)
+{
+	int i, errors = 0;
+
+	histogram_reset(&hist);
+	for (i = 1; i <= NV; i++)
+		histogram_add(&hist, i);
+	errors += check_percentile(0, 1);
+	errors += check_percentile(50, NV / 2);
+	errors += check_percentile(90, NV * 9 / 10);
+	errors += check_percentile(99, NV * 99 / 100);
+	errors += check_percentile(99.9, NV * 999 / 1000);
+	errors += histogram_percentile(&hist, 100) != NV;
+	return errors;
+}
+
+static int test_large(void)
+{
+	int errors = 0;
+
+	histogram_reset(&hist);
+	histogram_add(&hist, 1000);
+	histogram_add(&hist, 1ULL << 50);
+	errors += check_percentile(50, 1000);
+	errors += histogram_percentile(&hist, 100) != 1ULL << 50;
+	return errors;
+}
+
+static int tick_cb(struct event *evt __attribute__((unused)),
+		    uint32_t events __attribute__((unused)))
+{
+	return EVENTCB_CONTINUE;
+}
+
+/* The dispatcher records lateness, run time and dispatch delay of timers */
+static int test_dispatcher(void)
+{
+	static const enum dsp_histogram hists[] = {
+		DSP_HIST_LATENESS, DSP_HIST_CALLBACK, DSP_HIST_DISPATCH,
+	};
+	struct dispatcher *dsp;
+	struct dispatcher_stats st;
+	struct event evts[N_TIMERS];
+	unsigned long long ns;
+	unsigned int i;
+	int errors = 0;
+
+	if (!(dsp = new_dispatcher(CLOCK_MONOTONIC)))
+		return 1;
+	errors += dispatcher_get_percentile(dsp, DSP_HIST_CALLBACK, 50, &ns) !=
+		-ENODATA;
+	errors += dispatcher_set_histograms(dsp, true) != 0;
+	errors += dispatcher_get_percentile(dsp, DSP_HIST_CALLBACK, 50, &ns) !=
+		-ENODATA;
+	for (i = 0; i < N_TIMERS; i++) {
+		evts[i] = TIMER_EVENT_ON_STACK(tick_cb, 1000 * (i + 1));
+		evts[i].cleanup = NULL;
+		errors += event_add(dsp, &evts[i]) != 0;
+	}
+	/* wait until all timers have expired */
+	do {
+		if (event_wait(dsp, NULL) < 0) {
+			errors++;
+			break;
+		}
+		dispatcher_get_stats(dsp, &st);
+	} while (st.expired < N_TIMERS);
+	for (i = 0; i < sizeof(hists) / sizeof(*hists); i++) {
+		if (dispatcher_get_percentile(dsp, hists[i], 99, &ns) != 0) {
+			fprintf(stderr, "no data in histogram %u\n", hists[i]);
+			errors++;
+		} else
+			fprintf(stderr, "histogram %u: p99 %llu ns\n",
+				hists[i], ns);
+	}
+	errors += dispatcher_get_percentile(dsp, DSP_HIST_CALLBACK, 101, &ns) !=
+		-EINVAL;
+	errors += dispatcher_set_histograms(dsp, false) != 0;
+	errors += dispatcher_get_percentile(dsp, DSP_HIST_CALLBACK, 50, &ns) !=
+		-ENODATA;
+	free_dispatcher(dsp);
+	return errors;
+}
+
+#define STALL_NS 1000000ULL
+
+static struct {
+	const struct event *evt;
+	cb_fn callback;
+	int fd;
+	unsigned long long ns;
+	unsigned int calls, stalls;
+} stall;
+
+static void stall_hook(const struct event *evt, cb_fn callback, int fd,
+		       unsigned long long ns, void *arg)
+{
+	if (arg != &stall)
+		return;
+	if (evt) {
+		stall.evt = evt;
+		stall.callback = callback;
+		stall.fd = fd;
+		stall.ns = ns;
+		stall.calls++;
+	} else
+		stall.stalls++;
+}
+
+static void busy_wait(uint64_t ns)
+{
+	struct timespec start, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	while ((now.tv_sec - start.tv_sec) * 1000000000ULL +
+	       now.tv_nsec - start.tv_nsec < ns);
+}
+
+/* fd_slow busy-waits twice as long as the watchdog threshold */
+static int fd_slow = -1;
+
+static int read_cb(struct event *evt, uint32_t events __attribute__((unused)))
+{
+	uint64_t val;
+
+	if (read(evt->fd, &val, sizeof(val)) != sizeof(val))
+		return EVENTCB_CLEANUP;
+	if (evt->fd == fd_slow)
+		busy_wait(2 * STALL_NS);
+	return EVENTCB_CONTINUE;
+}
+
+static int trigger(struct dispatcher *dsp, int fd)
+{
+	static const uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) != sizeof(one))
+		return 1;
+	return event_wait(dsp, NULL) < 0;
+}
+
+/* The watchdog reports the slow callback, and the stalled loop */
+static int test_watchdog(void)
+{
+	static const struct timespec threshold = { 0, STALL_NS, };
+	static const struct timespec off = { 0, 0, };
+	struct dispatcher *dsp;
+	struct dispatcher_stats st;
+	struct event fast, slow;
+	int errors = 0, fd_fast;
+
+	if (!(dsp = new_dispatcher(CLOCK_MONOTONIC)))
+		return 1;
+	fd_fast = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	fd_slow = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	fast = EVENT_ON_STACK(read_cb, fd_fast, EPOLLIN);
+	slow = EVENT_ON_STACK(read_cb, fd_slow, EPOLLIN);
+	if (fd_fast == -1 || fd_slow == -1 ||
+	    event_add(dsp, &fast) != 0 || event_add(dsp, &slow) != 0) {
+		free_dispatcher(dsp);
+		return 1;
+	}
+	errors += dispatcher_set_watchdog(NULL, &threshold, NULL, NULL) !=
+		-EINVAL;
+	errors += dispatcher_set_watchdog(dsp, &threshold, stall_hook, &stall)
+		!= 0;
+
+	errors += trigger(dsp, fd_slow);
+	if (stall.calls != 1 || stall.evt != &slow ||
+	    stall.callback != read_cb || stall.fd != fd_slow ||
+	    stall.ns < 2 * STALL_NS || stall.stalls != 1) {
+		fprintf(stderr, "slow callback: %u calls, %u stalls\n",
+			stall.calls, stall.stalls);
+		errors++;
+	}
+
+	/* neither fast callbacks, nor disabled watchdogs report anything */
+	errors += trigger(dsp, fd_fast);
+	errors += dispatcher_set_watchdog(dsp, &off, stall_hook, &stall) != 0;
+	errors += trigger(dsp, fd_slow);
+	dispatcher_get_stats(dsp, &st);
+	if (stall.calls != 1 || stall.stalls != 1 ||
+	    st.slow_callbacks != 1 || st.loop_stalls != 1) {
+		fprintf(stderr, "fast callback: %u calls, %u stalls\n",
+			stall.calls, stall.stalls);
+		errors++;
+	}
+	free_dispatcher(dsp);
+	return errors;
+}
+
+int main(void)
+{
+	int n_err = 0;
+
+	log_level = LOG_WARNING;
+	n_err += test_small();
+	n_err += test_uniform();
+	n_err += test_large();
+	n_err += test_dispatcher();
+	n_err += test_watchdog();
+	fprintf(stderr, "TESTS FINISHED, %d errors\n", n_err);
+	return n_err ? 1 : 0;
+}
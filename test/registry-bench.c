@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2021 Martin Wilck, SUSE LLC
+ * SPDX-License-Identifier: GPL-2.0-or-newer
+ */
+#include "bench.h"
+
+/*
+ * Measure the per-operation cost and the memory usage of the event
+ * registry for different numbers of registered events. All events are
+ * timers without timeout, so that the timeout handling code doesn't
+ * distort the results.
+ */
+
+#define DEF_MAX_EVENTS 1000000
+#define DEF_N_OPS 1000000
+
+static int max_events = DEF_MAX_EVENTS;
+static int n_ops = DEF_N_OPS;
+
+static const struct timespec null_ts;
+
+static int bench(int n)
+{
+	struct dispatcher *dsp;
+	struct event *evts;
+	struct timespec start;
+	struct dispatcher_stats st;
+	double t_lookup, t_churn;
+	int i, rc = 0;
+
+	if ((evts = calloc(n, sizeof(*evts))) == NULL)
+		return -ENOMEM;
+	if ((dsp = new_dispatcher(CLOCK_MONOTONIC)) == NULL) {
+		free(evts);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < n; i++) {
+		evts[i] = EVENT_ON_STACK(dummy_cb, -1, 0);
+		if ((rc = event_add(dsp, &evts[i])) < 0) {
+			msg(LOG_ERR, "event_add: %s\n", strerror(-rc));
+			goto out;
+		}
+	}
+
+	/* lookup: event_mod_timeout() for an event without timeout */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n_ops; i++) {
+		if ((rc = event_mod_timeout(&evts[random() % n], &null_ts)) < 0) {
+			msg(LOG_ERR, "event_mod_timeout: %s\n", strerror(-rc));
+			goto out;
+		}
+	}
+	t_lookup = elapsed_ns(&start) / n_ops;
+
+	/* churn: remove a random event and add it again */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n_ops; i++) {
+		struct event *evt = &evts[random() % n];
+
+		if ((rc = event_remove(evt)) < 0 ||
+		    (rc = event_add(dsp, evt)) < 0) {
+			msg(LOG_ERR, "remove/add: %s\n", strerror(-rc));
+			goto out;
+		}
+	}
+	t_churn = elapsed_ns(&start) / n_ops;
+
+	dispatcher_get_stats(dsp, &st);
+	if (st.n_events != (unsigned int)n) {
+		msg(LOG_ERR, "%u events registered, expected %d\n",
+		    st.n_events, n);
+		rc = -EIO;
+		goto out;
+	}
+	printf("%10d %12.1f %12.1f %12.1f\n", n, t_lookup, t_churn,
+	       (double)st.registry_bytes / n);
+out:
+	free_dispatcher(dsp);
+	free(evts);
+	return rc;
+}
+
+static const struct bench_option options[] = {
+	{ 'n', "max-events", "<n>", "max number of registered events",
+	  &max_events, NULL, },
+	{ 'o', "ops", "<n>", "operations per measurement", &n_ops, NULL, },
+	{ 0, },
+};
+
+int main(int argc, char *const argv[])
+{
+	int n;
+
+	if (bench_init(argc, argv, options, NULL, NULL) != 0)
+		return 1;
+
+	printf("%10s %12s %12s %12s\n", "#events", "lookup/ns", "churn/ns",
+	       "bytes/event");
+	for (n = 10; n <= max_events; n *= 10)
+		if (bench(n) < 0)
+			return 1;
+	return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2021 Martin Wilck, SUSE LLC
+ * SPDX-License-Identifier: GPL-2.0-or-newer
+ */
+#include "bench.h"
+
+/*
+ * Compare the cost of ts_search() on an array of pointers with
+ * ts_search_keys() on packed keys and ts_search_eytzinger() on keys in
+ * Eytzinger layout, for different array sizes. Search values are random,
+ * so that the branches of ts_search() are unpredictable.
+ */
+
+#define DEF_MAX_SIZE 10000000
+#define DEF_N_OPS 1000000
+
+static int max_size = DEF_MAX_SIZE;
+static int n_ops = DEF_N_OPS;
+
+static void random_ts(struct timespec *ts)
+{
+	ts->tv_sec = random() % 100000;
+	ts->tv_nsec = random() % 1000000000L;
+}
+
+static int bench(int n)
+{
+	struct timespec *tss, **ptss, *probes, start;
+	uint64_t *keys, *eyt;
+	long *order, sum[3] = { 0, };
+	double t[3];
+	int i, rc = -ENOMEM;
+
+	tss = calloc(n, sizeof(*tss));
+	ptss = calloc(n, sizeof(*ptss));
+	probes = calloc(n_ops, sizeof(*probes));
+	keys = calloc(n, sizeof(*keys));
+	eyt = calloc(n + 1, sizeof(*eyt));
+	order = calloc(n + 1, sizeof(*order));
+	if (!tss || !ptss || !probes || !keys || !eyt || !order)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		random_ts(&tss[i]);
+		ptss[i] = &tss[i];
+	}
+	ts_sort(ptss, n);
+	for (i = 0; i < n; i++)
+		keys[i] = ts_to_key(ptss[i]);
+	ts_eytzinger(keys, n, eyt, order);
+	for (i = 0; i < n_ops; i++)
+		random_ts(&probes[i]);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n_ops; i++)
+		sum[0] += ts_search(ptss, n, &probes[i]);
+	t[0] = elapsed_ns(&start) / n_ops;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n_ops; i++)
+		sum[1] += ts_search_keys(keys, n, &probes[i]);
+	t[1] = elapsed_ns(&start) / n_ops;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n_ops; i++)
+		sum[2] += ts_search_eytzinger(eyt, order, n, &probes[i]);
+	t[2] = elapsed_ns(&start) / n_ops;
+
+	/* The sums also keep the compiler from dropping the searches */
+	if (sum[1] != sum[0] || sum[2] != sum[0]) {
+		msg(LOG_ERR, "search results differ for %d elements\n", n);
+		rc = -EIO;
+		goto out;
+	}
+
+	printf("%10d %12.1f %12.1f %12.1f\n", n, t[0], t[1], t[2]);
+	rc = 0;
+out:
+	free(order);
+	free(eyt);
+	free(keys);
+	free(probes);
+	free(ptss);
+	free(tss);
+	return rc;
+}
+
+static const struct bench_option options[] = {
+	{ 'n', "max-size", "<n>", "max number of array elements",
+	  &max_size, NULL, },
+	{ 'o', "ops", "<n>", "searches per measurement", &n_ops, NULL, },
+	{ 0, },
+};
+
+int main(int argc, char *const argv[])
+{
+	int n;
+
+	if (bench_init(argc, argv, options, NULL, NULL) != 0)
+		return 1;
+
+	printf("%10s %12s %12s %12s\n", "#elements", "search/ns",
+	       "keys/ns", "eytzinger/ns");
+	for (n = 10; n <= max_size; n *= 10)
+		if (bench(n) < 0)
+			return 1;
+	return 0;
+}
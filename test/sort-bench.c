@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2021 Martin Wilck, SUSE LLC
+ * SPDX-License-Identifier: GPL-2.0-or-newer
+ */
+#include "bench.h"
+
+/*
+ * Compare sorting an array of struct timespec pointers with qsort() and
+ * ts_sort(), and bulk-loading @n elements into a sorted array of @n
+ * elements with ts_insert() and ts_insert_many().
+ */
+
+#define DEF_MAX_SIZE 1000000
+/* ts_insert() is O(n) per element */
+#define DEF_MAX_INSERT 100000
+
+static int max_size = DEF_MAX_SIZE;
+static int max_insert = DEF_MAX_INSERT;
+
+static int compare_q(const void *p1, const void *p2)
+{
+	return ts_compare(*(struct timespec * const *)p1,
+			  *(struct timespec * const *)p2);
+}
+
+static void random_ts(struct timespec *ts)
+{
+	ts->tv_sec = random() % 100000;
+	ts->tv_nsec = random() % 1000000000L;
+}
+
+static int bench(int n)
+{
+	struct timespec *tss, **ptss, **sorted, start;
+	double t_qsort, t_sort, t_insert = -1, t_many;
+	size_t len;
+	int i, rc = -ENOMEM;
+
+	tss = calloc(2 * n, sizeof(*tss));
+	ptss = calloc(2 * n, sizeof(*ptss));
+	sorted = calloc(2 * n, sizeof(*sorted));
+	if (!tss || !ptss || !sorted)
+		goto out;
+
+	for (i = 0; i < 2 * n; i++) {
+		random_ts(&tss[i]);
+		ptss[i] = &tss[i];
+	}
+
+	memcpy(sorted, ptss, n * sizeof(*sorted));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	qsort(sorted, n, sizeof(*sorted), compare_q);
+	t_qsort = elapsed_ns(&start) / n;
+
+	memcpy(sorted, ptss, n * sizeof(*sorted));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ts_sort(sorted, n);
+	t_sort = elapsed_ns(&start) / n;
+
+	/* insert the second half of the elements into the sorted first half */
+	if (n <= max_insert) {
+		len = n;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = n; i < 2 * n; i++)
+			ts_insert(sorted, &len, 2 * n, ptss[i]);
+		t_insert = elapsed_ns(&start) / n;
+		memcpy(sorted, ptss, n * sizeof(*sorted));
+		ts_sort(sorted, n);
+	}
+
+	len = n;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if ((rc = ts_insert_many(sorted, &len, 2 * n, ptss + n, n)) < 0) {
+		msg(LOG_ERR, "ts_insert_many: %s\n", strerror(-rc));
+		goto out;
+	}
+	t_many = elapsed_ns(&start) / n;
+
+	for (i = 1; i < 2 * n; i++)
+		if (ts_compare(sorted[i - 1], sorted[i]) > 0) {
+			msg(LOG_ERR, "array not sorted for %d elements\n", n);
+			rc = -EIO;
+			goto out;
+		}
+
+	printf("%10d %12.1f %12.1f ", n, t_qsort, t_sort);
+	if (t_insert < 0)
+		printf("%12s ", "-");
+	else
+		printf("%12.1f ", t_insert);
+	printf("%12.1f\n", t_many);
+	rc = 0;
+out:
+	free(sorted);
+	free(ptss);
+	free(tss);
+	return rc;
+}
+
+static const struct bench_option options[] = {
+	{ 'n', "max-size", "<n>", "max number of array elements",
+	  &max_size, NULL, },
+	{ 'i', "max-insert", "<n>", "max number of elements for ts_insert()",
+	  &max_insert, NULL, },
+	{ 0, },
+};
+
+int main(int argc, char *const argv[])
+{
+	int n;
+
+	if (bench_init(argc, argv, options, NULL, NULL) != 0)
+		return 1;
+
+	printf("%10s %12s %12s %12s %12s\n", "#elements", "qsort/ns",
+	       "sort/ns", "insert/ns", "many/ns");
+	for (n = 10; n <= max_size; n *= 10)
+		if (bench(n) < 0)
+			return 1;
+	return 0;
+}
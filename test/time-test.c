@@ -81,11 +81,108 @@ int TT##_##NAME(void)                                                   \
 #define T_TEST(TT, TYPE) __T_TEST(TT, TYPE, test, INIT_NO_EQUALS)
 #define T_TEST1(TT, TYPE) __T_TEST(TT, TYPE, test1, INIT_WITH_EQUALS)
 
+/*
+ * Compare the results of the key searches with TT_search(), for arrays
+ * of random size. Search both for random values and for array elements.
+ */
+#define __T_TEST_KEYS(TT, TYPE, NAME, INIT)				\
+int TT##_##NAME(void)                                                   \
+{                                                                       \
+        int i, errors = 0;						\
+        TYPE tv[NTV], tq[NTV], t;                                       \
+        TYPE *ptv[NTV];							\
+        uint64_t keys[NTV], eyt[NTV + 1];				\
+        long order[NTV + 1], pos;					\
+        size_t n = random() % (NTV + 1);				\
+                                                                        \
+        for (i = 0; i < NTV; i++)  {					\
+                TT##_random(&tv[i]);                                    \
+	}								\
+        for (i = 0; i < NTV; i++) {                                     \
+		INIT;							\
+	}								\
+        for (i = 0; i < NTV; i++) {                                     \
+                TT##_normalize(&tq[i]);                                 \
+		ptv[i] = &tq[i];					\
+        }                                                               \
+                                                                        \
+        TT##_sort(ptv, n);                                              \
+        for (i = 0; i < (int)n; i++) {                                  \
+                keys[i] = TT##_to_key(ptv[i]);                          \
+	}								\
+        TT##_eytzinger(keys, n, eyt, order);                            \
+                                                                        \
+        for (i = 0; i < 2 * NTV; i++) {                                 \
+		if (i % 2)						\
+			TT##_random(&t);				\
+		else							\
+			t = tq[i / 2];					\
+		pos = TT##_search(ptv, n, &t);				\
+		if (TT##_search_keys(keys, n, &t) != pos)		\
+			errors++;					\
+		if (TT##_search_eytzinger(eyt, order, n, &t) != pos)	\
+			errors++;					\
+        }                                                               \
+									\
+	return errors;							\
+}
+
+/*
+ * Insert the elements in batches of random size with TT_insert_many(),
+ * and compare with the result of TT_sort().
+ */
+#define __T_TEST_MANY(TT, TYPE, NAME, INIT)				\
+int TT##_##NAME(void)                                                   \
+{                                                                       \
+        int i, errors = 0;						\
+        TYPE tv[NTV], tq[NTV];                                          \
+        TYPE *ptv[NTV], *qtv[NTV], *batch[NTV];				\
+        size_t ntv = 0, n, j;                                           \
+                                                                        \
+        for (i = 0; i < NTV; i++)  {					\
+                TT##_random(&tv[i]);                                    \
+	}								\
+        for (i = 0; i < NTV; i++) {                                     \
+		INIT;							\
+	}								\
+        for (i = 0; i < NTV; i++) {                                     \
+		tv[i] = tq[i];						\
+		qtv[i] = &tq[i];					\
+		TT##_normalize(qtv[i]);					\
+        }                                                               \
+        for (i = 0; i < NTV; i += n) {                                  \
+		n = random() % 200 + 1;					\
+		if (n > (size_t)(NTV - i))				\
+			n = NTV - i;					\
+		for (j = 0; j < n; j++)					\
+			batch[j] = &tv[i + j];				\
+		if (TT##_insert_many(ptv, &ntv, NTV, batch, n) != 0)	\
+			errors++;					\
+        }                                                               \
+                                                                        \
+        TT##_sort(qtv, NTV);                                            \
+                                                                        \
+        for (i = 0; i < NTV; i++) {                                     \
+		if (TT##_compare(ptv[i], qtv[i]) != 0)			\
+			errors++;					\
+        }                                                               \
+									\
+	return errors;							\
+}
+
+#define T_TEST_MANY(TT, TYPE) __T_TEST_MANY(TT, TYPE, test_many, INIT_WITH_EQUALS)
+
+#define T_TEST_KEYS(TT, TYPE) __T_TEST_KEYS(TT, TYPE, test_keys, INIT_NO_EQUALS)
+#define T_TEST_KEYS1(TT, TYPE) __T_TEST_KEYS(TT, TYPE, test_keys1, INIT_WITH_EQUALS)
+
 #define TEST_FUNCTIONS(TT, TYPE, MEMB, FACT)        \
         static T_RANDOM(TT, TYPE, MEMB);            \
         static T_PRINT(TT, TYPE, MEMB, FACT);       \
         static T_TEST(TT, TYPE);		    \
-        static T_TEST1(TT, TYPE);
+        static T_TEST1(TT, TYPE);		    \
+        static T_TEST_KEYS(TT, TYPE);		    \
+        static T_TEST_KEYS1(TT, TYPE);		    \
+        static T_TEST_MANY(TT, TYPE);
 
 #if GEN_TV == 1
 TEST_FUNCTIONS(tv, struct timeval, tv_usec, 1000000L);
@@ -103,12 +200,24 @@ int main(void)
                 n_err += tv_test();
         for (i = 0; i < NR; i++)
                 n_err += tv_test1();
+        for (i = 0; i < NR; i++)
+                n_err += tv_test_keys();
+        for (i = 0; i < NR; i++)
+                n_err += tv_test_keys1();
+        for (i = 0; i < NR; i++)
+                n_err += tv_test_many();
 #endif
 #if GEN_TS == 1
         for (i = 0; i < NR; i++)
                 n_err += ts_test();
         for (i = 0; i < NR; i++)
                 n_err += ts_test1();
+        for (i = 0; i < NR; i++)
+                n_err += ts_test_keys();
+        for (i = 0; i < NR; i++)
+                n_err += ts_test_keys1();
+        for (i = 0; i < NR; i++)
+                n_err += ts_test_many();
 #endif
 	fprintf(stderr, "TESTS FINISHED, %d errors (#items: %d, #runs: %d)\n",
 		n_err, NTV, NR);
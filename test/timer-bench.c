@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2021 Martin Wilck, SUSE LLC
+ * SPDX-License-Identifier: GPL-2.0-or-newer
+ */
+#include "bench.h"
+
+/*
+ * Measure the per-operation cost of timeout handling for different
+ * numbers of pending timeouts and different timeout stores.
+ * All timeouts are far in the future, so that none of them expires
+ * while the benchmark is running.
+ */
+
+#define DEF_MAX_TIMERS 1000000
+/* adding and moving timeouts is O(n) for the sorted array */
+#define DEF_MAX_SORTED 100000
+#define DEF_N_OPS 100000
+
+#define _STR(x) #x
+#define STR(x) _STR(x)
+
+static int max_timers = DEF_MAX_TIMERS;
+static bool max_timers_set;
+static int n_expired;
+static int n_ops = DEF_N_OPS;
+static bool lazy;
+static int slack_us;
+static bool no_timerfd;
+/* TMO_LAZY or 0 */
+static unsigned short tmo_flags;
+/* timer slack for the expiry benchmark */
+static struct timespec slack;
+/* DSP_NO_TIMERFD or 0 */
+static unsigned int dsp_flags;
+
+static const struct timespec null_ts;
+
+/* "class" puts all timeouts into a single timeout class */
+static const struct {
+	const char *name;
+	unsigned int flags;
+	bool use_class;
+	int def_max;
+} stores[] = {
+	{ "sorted", DSP_TMO_SORTED, false, DEF_MAX_SORTED, },
+	{ "heap", DSP_TMO_HEAP, false, DEF_MAX_TIMERS, },
+	{ "wheel", DSP_TMO_WHEEL, false, DEF_MAX_TIMERS, },
+	{ "class", DSP_TMO_SORTED, true, DEF_MAX_TIMERS, },
+};
+
+static const struct timespec class_tmo = { .tv_sec = 1500, };
+
+static int expire_cb(struct event *evt __attribute__((unused)),
+		     uint32_t events __attribute__((unused)))
+{
+	n_expired++;
+	return EVENTCB_CONTINUE;
+}
+
+/* random relative timeout between 1000 and 2000s */
+static void random_tmo(struct timespec *ts)
+{
+	ts->tv_sec = 1000 + random() % 1000;
+	ts->tv_nsec = random() % 1000000000L;
+}
+
+static int set_tmo(struct event *evt, int cls)
+{
+	struct timespec tmo;
+
+	if (cls > 0)
+		return event_mod_tmo_class(evt, cls);
+	random_tmo(&tmo);
+	return event_mod_timeout(evt, &tmo);
+}
+
+/*
+ * expire: set up @n timeouts which expire within 1ms, wait until
+ * all of them have expired, and measure the time it takes to process them.
+ */
+static double bench_expire(unsigned int flags, struct event *evts, int n)
+{
+	struct dispatcher *dsp;
+	struct timespec start, wait = { .tv_nsec = 2000000, };
+	double t_exp = -1;
+	int i, rc;
+
+	if ((dsp = new_dispatcher_ext(CLOCK_MONOTONIC, flags | dsp_flags)) == NULL)
+		return -1;
+	if ((rc = dispatcher_set_timer_slack(dsp, &slack)) < 0) {
+		msg(LOG_ERR, "dispatcher_set_timer_slack: %s\n", strerror(-rc));
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		evts[i] = TIMER_EVENT_ON_STACK(expire_cb, i * 1000LL / n);
+		evts[i].flags = tmo_flags;
+		if ((rc = event_add(dsp, &evts[i])) < 0) {
+			msg(LOG_ERR, "event_add: %s\n", strerror(-rc));
+			goto out;
+		}
+	}
+	nanosleep(&wait, NULL);
+
+	n_expired = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (n_expired < n)
+		if ((rc = event_wait(dsp, NULL)) < 0) {
+			msg(LOG_ERR, "event_wait: %s\n", strerror(-rc));
+			goto out;
+		}
+	t_exp = elapsed_ns(&start) / n;
+out:
+	free_dispatcher(dsp);
+	return t_exp;
+}
+
+static int bench(const char *name, unsigned int flags, bool use_class, int n)
+{
+	struct dispatcher *dsp;
+	struct event *evts;
+	struct timespec start;
+	double t_add, t_mod, t_cancel, t_exp;
+	int i, cls = 0, rc = 0;
+
+	if ((evts = calloc(n, sizeof(*evts))) == NULL)
+		return -ENOMEM;
+	if ((dsp = new_dispatcher_ext(CLOCK_MONOTONIC, flags)) == NULL) {
+		free(evts);
+		return -ENOMEM;
+	}
+	if (use_class && (rc = cls = dispatcher_add_tmo_class(dsp, &class_tmo)) < 0) {
+		msg(LOG_ERR, "dispatcher_add_tmo_class: %s\n", strerror(-rc));
+		goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++) {
+		evts[i] = EVENT_ON_STACK(dummy_cb, -1, 0);
+		random_tmo(&evts[i].tmo);
+		evts[i].tmo_class = cls;
+		evts[i].flags = tmo_flags;
+		if ((rc = event_add(dsp, &evts[i])) < 0) {
+			msg(LOG_ERR, "event_add: %s\n", strerror(-rc));
+			goto out;
+		}
+	}
+	t_add = elapsed_ns(&start) / n;
+
+	/*
+	 * modify: move a random timeout to a random new position,
+	 * or refresh it for "class"
+	 */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n_ops; i++) {
+		if ((rc = set_tmo(&evts[random() % n], cls)) < 0) {
+			msg(LOG_ERR, "modify: %s\n", strerror(-rc));
+			goto out;
+		}
+	}
+	t_mod = elapsed_ns(&start) / n_ops;
+
+	/* cancel: cancel a random timeout and set it again */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n_ops; i++) {
+		struct event *evt = &evts[random() % n];
+
+		if ((rc = event_mod_timeout(evt, &null_ts)) < 0 ||
+		    (rc = set_tmo(evt, cls)) < 0) {
+			msg(LOG_ERR, "cancel/set: %s\n", strerror(-rc));
+			goto out;
+		}
+	}
+	t_cancel = elapsed_ns(&start) / n_ops;
+
+	free_dispatcher(dsp);
+	dsp = NULL;
+	/* Classes have a fixed timeout, the expiry would use the sorted store */
+	t_exp = use_class ? 0 : bench_expire(flags, evts, n);
+	if (t_exp < 0) {
+		rc = -EIO;
+		goto out;
+	}
+
+	printf("%-8s %10d %12.1f %12.1f %12.1f ",
+	       name, n, t_add, t_mod, t_cancel);
+	if (use_class)
+		printf("%12s\n", "-");
+	else
+		printf("%12.1f\n", t_exp);
+out:
+	if (dsp)
+		free_dispatcher(dsp);
+	free(evts);
+	return rc;
+}
+
+static const struct bench_option options[] = {
+	{ 'n', "max-timers", "<n>", "max number of pending timeouts",
+	  &max_timers, &max_timers_set, },
+	{ 'o', "ops", "<n>", "operations per measurement", &n_ops, NULL, },
+	{ 'l', "lazy", NULL, "use lazy timeout refresh (TMO_LAZY)",
+	  NULL, &lazy, },
+	{ 's', "slack", "<us>", "timer slack for expiry", &slack_us, NULL, },
+	{ 'T', "no-timerfd", NULL, "use DSP_NO_TIMERFD for expiry",
+	  NULL, &no_timerfd, },
+	{ 0, },
+};
+
+static const char footer[] =
+	"Stores: sorted, heap, wheel, class (default: all)\n"
+	"The sorted store is limited to " STR(DEF_MAX_SORTED)
+	" timeouts unless -n is given.\n";
+
+int main(int argc, char *const argv[])
+{
+	unsigned int s;
+	int n;
+
+	if (bench_init(argc, argv, options, "[store...]", footer) != 0)
+		return 1;
+	if (lazy)
+		tmo_flags |= TMO_LAZY;
+	if (no_timerfd)
+		dsp_flags |= DSP_NO_TIMERFD;
+	us_to_ts(slack_us, &slack);
+
+	printf("%-8s %10s %12s %12s %12s %12s\n", "store", "#timers",
+	       "add/ns", "modify/ns", "cancel/ns", "expire/ns");
+	for (s = 0; s < sizeof(stores) / sizeof(*stores); s++) {
+		int max = max_timers;
+
+		if (!selected(stores[s].name, argc, argv))
+			continue;
+		if (!max_timers_set && stores[s].def_max < max)
+			max = stores[s].def_max;
+		for (n = 10; n <= max; n *= 10)
+			if (bench(stores[s].name, stores[s].flags,
+				  stores[s].use_class, n) < 0)
+				return 1;
+	}
+	return 0;
+}
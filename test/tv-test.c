@@ -88,6 +88,122 @@ static int tv_test1(void)
 			errors++;
 	}
 	return errors;
+};
+
+static int tv_test_keys(void)
+{
+	int i, errors = 0;
+	struct timeval tv[1000], tq[1000], t;
+	struct timeval *ptv[1000];
+	uint64_t keys[1000], eyt[1000 + 1];
+	long order[1000 + 1], pos;
+	size_t n = random() % (1000 + 1);
+	for (i = 0; i < 1000; i++) {
+		tv_random(&tv[i]);
+	}
+	for (i = 0; i < 1000; i++) {
+		do {
+			tq[i] = tv[i];
+		} while (0);
+	}
+	for (i = 0; i < 1000; i++) {
+		tv_normalize(&tq[i]);
+		ptv[i] = &tq[i];
+	}
+	tv_sort(ptv, n);
+	for (i = 0; i < (int)n; i++) {
+		keys[i] = tv_to_key(ptv[i]);
+	}
+	tv_eytzinger(keys, n, eyt, order);
+	for (i = 0; i < 2 * 1000; i++) {
+		if (i % 2)
+			tv_random(&t);
+		else
+			t = tq[i / 2];
+		pos = tv_search(ptv, n, &t);
+		if (tv_search_keys(keys, n, &t) != pos)
+			errors++;
+		if (tv_search_eytzinger(eyt, order, n, &t) != pos)
+			errors++;
+	}
+	return errors;
+};
+
+static int tv_test_keys1(void)
+{
+	int i, errors = 0;
+	struct timeval tv[1000], tq[1000], t;
+	struct timeval *ptv[1000];
+	uint64_t keys[1000], eyt[1000 + 1];
+	long order[1000 + 1], pos;
+	size_t n = random() % (1000 + 1);
+	for (i = 0; i < 1000; i++) {
+		tv_random(&tv[i]);
+	}
+	for (i = 0; i < 1000; i++) {
+		do {
+			int j = random() % 1000;
+			tq[i] = tv[j];
+		} while (0);
+	}
+	for (i = 0; i < 1000; i++) {
+		tv_normalize(&tq[i]);
+		ptv[i] = &tq[i];
+	}
+	tv_sort(ptv, n);
+	for (i = 0; i < (int)n; i++) {
+		keys[i] = tv_to_key(ptv[i]);
+	}
+	tv_eytzinger(keys, n, eyt, order);
+	for (i = 0; i < 2 * 1000; i++) {
+		if (i % 2)
+			tv_random(&t);
+		else
+			t = tq[i / 2];
+		pos = tv_search(ptv, n, &t);
+		if (tv_search_keys(keys, n, &t) != pos)
+			errors++;
+		if (tv_search_eytzinger(eyt, order, n, &t) != pos)
+			errors++;
+	}
+	return errors;
+};
+
+static int tv_test_many(void)
+{
+	int i, errors = 0;
+	struct timeval tv[1000], tq[1000];
+	struct timeval *ptv[1000], *qtv[1000], *batch[1000];
+	size_t ntv = 0, n, j;
+	for (i = 0; i < 1000; i++) {
+		tv_random(&tv[i]);
+	}
+	for (i = 0; i < 1000; i++) {
+		do {
+			int j = random() % 1000;
+			tq[i] = tv[j];
+		} while (0);
+	}
+	for (i = 0; i < 1000; i++) {
+		tv[i] = tq[i];
+		qtv[i] = &tq[i];
+		tv_normalize(qtv[i]);
+	}
+	for (i = 0; i < 1000; i += n) {
+		n = random() % 200 + 1;
+		if (n > (size_t)(1000 - i))
+			n = 1000 - i;
+		for (j = 0; j < n; j++)
+			batch[j] = &tv[i + j];
+		if (tv_insert_many(ptv, &ntv, 1000, batch, n) != 0)
+			errors++;
+	}
+	tv_sort(qtv, 1000);
+	for (i = 0; i < 1000; i++) {
+		if (tv_compare(ptv[i], qtv[i]) != 0)
+			errors++;
+	}
+	return errors;
 };;
 
 int main(void)
@@ -97,6 +213,12 @@ int main(void)
 		n_err += tv_test();
 	for (i = 0; i < 1000; i++)
 		n_err += tv_test1();
+	for (i = 0; i < 1000; i++)
+		n_err += tv_test_keys();
+	for (i = 0; i < 1000; i++)
+		n_err += tv_test_keys1();
+	for (i = 0; i < 1000; i++)
+		n_err += tv_test_many();
 	fprintf(stderr, "TESTS FINISHED, %d errors (#items: %d, #runs: %d)\n",
 		n_err, 1000, 1000);
 	return n_err ? 1 : 0;
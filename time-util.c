@@ -2,6 +2,8 @@
  * Copyright (c) 2021 Martin Wilck, SUSE LLC
  * SPDX-License-Identifier: LGPL-2.1-or-newer
  */
+#include "key-array.h"
+
 #define T_NORMALIZE(TT, TYPE, MEMB, FACT)       \
 void TT##_normalize(TYPE *tv)                   \
 {                                               \
@@ -57,14 +59,80 @@ int TT##_compare_q(const TYPE **pt1, const TYPE **pt2)               \
         return TT##_compare(*pt1, *pt2);                             \
 }
 
+#define T_KEY_PTR(TT, TYPE)			\
+struct TT##_key_ptr {				\
+	uint64_t key;				\
+	TYPE *tv;				\
+};
+
+#define T_RADIX_SORT(TT)					\
+	KEY_RADIX_SORT(TT##_radix_sort, struct TT##_key_ptr, .key)
+
+#define T_SORT_RADIX(TT, TYPE)						\
+int TT##_sort_radix(TYPE **tvs, size_t size)				\
+{									\
+	struct TT##_key_ptr *kp, *res;					\
+	size_t i;							\
+									\
+	if (size > SIZE_MAX / (2 * sizeof(*kp)))			\
+		return -ENOMEM;						\
+	kp = malloc(2 * size * sizeof(*kp));				\
+	if (!kp)							\
+		return -ENOMEM;						\
+	for (i = 0; i < size; i++) {					\
+		kp[i].key = TT##_to_key(tvs[i]);			\
+		kp[i].tv = tvs[i];					\
+	}								\
+	res = TT##_radix_sort(kp, kp + size, size);			\
+	for (i = 0; i < size; i++)					\
+		tvs[i] = res[i].tv;					\
+	free(kp);							\
+	return 0;							\
+}
+
+/* Large arrays are radix sorted, qsort() is the fallback */
 #define T_SORT(TT, TYPE)                                               \
 void TT##_sort(TYPE **tvs, size_t size)                                \
 {                                                                      \
+	if (size >= KEY_RADIX_MIN && TT##_sort_radix(tvs, size) == 0)	\
+		return;							\
         qsort(tvs, size, sizeof(TYPE *),                               \
               (int (*)(const void *, const void *)) TT##_compare_q);   \
         return;							       \
 }
 
+/*
+ * Sort the new elements, and merge them into the array from the end,
+ * so that every element is moved at most once.
+ */
+#define T_INSERT_MANY(TT, TYPE)						\
+int TT##_insert_many(TYPE **tvs, size_t *len, size_t size,		\
+		     TYPE **new, size_t n)				\
+{									\
+	size_t i, j, k;							\
+									\
+	if (!tvs || !len || (n > 0 && !new))				\
+		return -EINVAL;						\
+	if (size < *len || size - *len < n)				\
+		return -EOVERFLOW;					\
+	for (i = 0; i < n; i++) {					\
+		if (!new[i])						\
+			return -EINVAL;					\
+		TT##_normalize(new[i]);					\
+	}								\
+	TT##_sort(new, n);						\
+									\
+	/* Like TT##_insert(), put new elements before equal ones */	\
+	for (i = *len, j = n, k = *len + n; j > 0; ) {			\
+		if (i > 0 && TT##_compare(tvs[i - 1], new[j - 1]) >= 0)	\
+			tvs[--k] = tvs[--i];				\
+		else							\
+			tvs[--k] = new[--j];				\
+	}								\
+	*len += n;							\
+	return 0;							\
+}
+
 #define T_SEARCH(TT, TYPE)                                              \
 long TT##_search(TYPE * const *tvs, size_t size, TYPE *new)		\
 {                                                                       \
@@ -114,6 +182,90 @@ long TT##_insert(TYPE **tvs, size_t *len, size_t size, TYPE *new)\
 	return pos;						\
 }
 
+/*
+ * Keys are the values in units of 1/FACT seconds, with the sign bit
+ * flipped, so that they compare like the time values as unsigned
+ * integers. Values out of range saturate.
+ */
+#define T_TO_KEY(TT, TYPE, MEMB, FACT)				\
+uint64_t TT##_to_key(const TYPE *tv)				\
+{								\
+	int64_t sec = tv->tv_sec;				\
+								\
+	if (sec > (INT64_MAX - FACT) / FACT)			\
+		return UINT64_MAX;				\
+	if (sec < INT64_MIN / FACT)				\
+		return 0;					\
+	return (uint64_t)(sec * FACT + tv->MEMB) ^ (1ULL << 63);	\
+}
+
+#define T_SEARCH_KEYS(TT, TYPE)						\
+static KEY_SEARCH(TT##_key_search, uint64_t, )				\
+									\
+long TT##_search_keys(const uint64_t *keys, size_t size, TYPE *new)	\
+{									\
+	if (!new || !keys || size > LONG_MAX)				\
+		return -EINVAL;						\
+									\
+	TT##_normalize(new);						\
+	return TT##_key_search(keys, size, TT##_to_key(new));		\
+}
+
+/*
+ * Eytzinger layout: the keys are stored like a binary heap, in the order
+ * of a breadth-first traversal of the bisection tree. The first levels
+ * of the tree share a few cache lines, and the next levels can be
+ * prefetched.
+ */
+#define T_EYTZINGER_FILL(TT)						\
+size_t TT##_eytzinger_fill(const uint64_t *keys, size_t len,		\
+			   uint64_t *eyt, long *order,			\
+			   size_t i, size_t k)				\
+{									\
+	if (k > len)							\
+		return i;						\
+	i = TT##_eytzinger_fill(keys, len, eyt, order, i, 2 * k);	\
+	eyt[k] = keys[i];						\
+	order[k] = i++;							\
+	return TT##_eytzinger_fill(keys, len, eyt, order, i, 2 * k + 1);	\
+}
+
+#define T_EYTZINGER(TT)							\
+int TT##_eytzinger(const uint64_t *keys, size_t len,			\
+		   uint64_t *eyt, long *order)				\
+{									\
+	if (!keys || !eyt || !order || len > LONG_MAX - 1)		\
+		return -EINVAL;						\
+									\
+	eyt[0] = 0;							\
+	order[0] = len;							\
+	TT##_eytzinger_fill(keys, len, eyt, order, 0, 1);		\
+	return 0;							\
+}
+
+#define T_SEARCH_EYTZINGER(TT, TYPE)					\
+long TT##_search_eytzinger(const uint64_t *eyt, const long *order,	\
+			   size_t len, TYPE *new)			\
+{									\
+	uint64_t key;							\
+	size_t k = 1;							\
+									\
+	if (!new || !eyt || !order || len > LONG_MAX - 1)		\
+		return -EINVAL;						\
+									\
+	TT##_normalize(new);						\
+	key = TT##_to_key(new);						\
+									\
+	while (k <= len) {						\
+		/* 8 keys per cache line: 3 levels ahead */		\
+		__builtin_prefetch(&eyt[8 * k]);			\
+		k = 2 * k + (eyt[k] < key);				\
+	}								\
+	/* Go back up past the right turns, and the last left turn */	\
+	k >>= __builtin_ffsl(~k);					\
+	return order[k];						\
+}
+
 #define T_FUNCTIONS(TT, TYPE, MEMB, FACT)  \
         T_NORMALIZE(TT, TYPE, MEMB, FACT)  \
         T_ADD(TT, TYPE, MEMB)              \
@@ -122,7 +274,16 @@ long TT##_insert(TYPE **tvs, size_t *len, size_t size, TYPE *new)\
         static T_COMPARE_Q(TT, TYPE)       \
         T_SEARCH(TT, TYPE)                 \
         T_INSERT(TT, TYPE)                 \
+        T_TO_KEY(TT, TYPE, MEMB, FACT)     \
+        T_KEY_PTR(TT, TYPE)                \
+        static T_RADIX_SORT(TT)            \
+        static T_SORT_RADIX(TT, TYPE)      \
         T_SORT(TT, TYPE)                   \
+        T_INSERT_MANY(TT, TYPE)            \
+        T_SEARCH_KEYS(TT, TYPE)            \
+        static T_EYTZINGER_FILL(TT)        \
+        T_EYTZINGER(TT)                    \
+        T_SEARCH_EYTZINGER(TT, TYPE)       \
 
 #if GEN_TV == 1
 T_FUNCTIONS(tv, struct timeval, tv_usec, 1000000L)
@@ -19,15 +19,115 @@
 #include "log.h"
 #include "timeout.h"
 #include "event.h"
+#include "histogram.h"
+#include "key-array.h"
+#include "trace.h"
+
+struct timeout_handler;
+
+/*
+ * Operations of a timeout store.
+ *
+ * @insert: insert @evt, with evt->tmo absolute and normalized.
+ * @remove: remove @evt. Return -ENOENT if it isn't found.
+ * @move: set evt->tmo to @new (absolute and normalized) and reposition @evt.
+ * @next_expiry: set @ts to the time the timer must be armed for.
+ *        Return false if the store is empty.
+ * @run_expired: remove all timeouts which expire before @now, and invoke
+ *        their callbacks.
+ * @reset: drop all timeouts.
+ * @shift: the clock has been set. Add @delta (in ns) to all relative
+ *        timeouts, and restore the order of the store.
+ * @flush: optional, end of a batch (see timeout_batch_begin()). Complete
+ *        the work that @insert and @remove have deferred while
+ *        th->batching was set.
+ *
+ * @insert, @remove, and @move return a negative error code on failure,
+ * a positive value if the timer needs to be re-armed, and 0 otherwise.
+ */
+struct timeout_ops {
+	int (*insert)(struct timeout_handler *th, struct event *evt);
+	int (*remove)(struct timeout_handler *th, struct event *evt);
+	int (*move)(struct timeout_handler *th, struct event *evt,
+		    struct timespec *new);
+	bool (*next_expiry)(struct timeout_handler *th, struct timespec *ts);
+	void (*run_expired)(struct timeout_handler *th, const struct timespec *now);
+	void (*reset)(struct timeout_handler *th);
+	void (*shift)(struct timeout_handler *th, int64_t delta);
+	void (*flush)(struct timeout_handler *th);
+};
+
+/*
+ * A timeout class: all events in @head expire @duration after they were
+ * added. New events are appended, thus the list is always sorted.
+ */
+struct tmo_class {
+	struct timespec duration;
+	struct __tmo_link head;
+};
+
+/*
+ * Element of the sorted array and the heap. The deadline is stored
+ * as nanoseconds next to the event, so that searching and scanning
+ * the array doesn't need to dereference the event pointers.
+ */
+struct tmo_entry {
+	uint64_t key;
+	struct event *evt;
+};
 
 struct timeout_handler {
         int source;
-        size_t len;
-        struct timespec **timeouts;
+	/*
+	 * clock for timeout_now() outside dispatch, coarse variant of
+	 * @source with DSP_COARSE_CLOCK. Never used for deadlines.
+	 */
+	int now_source;
+	/* cached time, valid while event_wait() dispatches events */
+	bool now_valid;
+	struct timespec now;
+	/* the sorted array starts at timeouts[first], for the heap first = 0 */
+        size_t first, len, size;
+        struct tmo_entry *timeouts;
+	/* buffer for expired timeouts, see sorted_run_expired() */
+	size_t batch_size;
+	struct tmo_entry *batch;
+	struct tmo_wheel *wheel;
+	unsigned int n_classes;
+	struct tmo_class **classes;
+	/* number of events in timeout classes */
+	size_t n_class_events;
+	const struct timeout_ops *ops;
+	/* the time the timerfd is armed for, {0, 0} if disarmed */
 	struct timespec expiry;
+	/* set while timeout_event() runs callbacks */
+	bool in_expiry;
+	/*
+	 * set between timeout_batch_begin() and timeout_batch_end(),
+	 * with the number of timeouts inserted and removed meanwhile
+	 */
+	bool batching;
+	size_t staged, dropped;
+	/* timer slack, see timeout_set_slack() */
+	uint64_t slack_ns;
+	/* the deadline the timer was armed for, before applying slack */
+	uint64_t armed_ns;
+	/* see timeout_event(), and the last key processed since */
+	uint64_t fired_ns, last_key;
+	/* CLOCK_REALTIME with timerfd: detect clock steps, see timeout_clock_set() */
+	bool cancel_on_set;
+	int64_t rt_offset;
+	struct timeout_stats stats;
+	/* lateness histogram, see timeout_set_histogram() */
+	struct histogram *hist;
 	struct event ev;
 };
 
+static const struct timeout_ops sorted_ops, heap_ops, wheel_ops;
+static int wheel_init(struct timeout_handler *th);
+static int64_t realtime_offset(void);
+static void timeout_clock_set(struct timeout_handler *th);
+
 int timeout_get_clocksource(const struct event *evt)
 {
 	return container_of_const(evt, struct timeout_handler, ev)->source;
@@ -40,7 +140,12 @@ static void free_timeout_handler(struct timeout_handler *th)
 
         if (th->timeouts)
                 free(th->timeouts);
+	free(th->batch);
 
+	free(th->wheel);
+	while (th->n_classes > 0)
+		free(th->classes[--th->n_classes]);
+	free(th->classes);
         free(th);
 }
 
@@ -49,20 +154,77 @@ void free_timeout_event(struct event *ev)
 	return free_timeout_handler(container_of(ev, struct timeout_handler, ev));
 }
 
-struct event *new_timeout_event(int source)
+struct event *new_timeout_event_ext(int source, unsigned int flags)
 {
         struct timeout_handler *th = calloc(1, sizeof(*th));
+	struct itimerspec it = { .it_value = { 0, 0 }, };
 
         if (!th)
                 return NULL;
-        th->ev.fd = timerfd_create(source, TFD_NONBLOCK|TFD_CLOEXEC);
-        if (th->ev.fd == -1) {
-                msg(LOG_ERR, "timerfd_create: %m\n");
-                free(th);
-                return NULL;
-        }
-        th->source = source;
-	th->ev.ep.events = EPOLLIN;
+
+	switch (flags & DSP_TMO_MASK) {
+	case DSP_TMO_SORTED:
+		th->ops = &sorted_ops;
+		break;
+	case DSP_TMO_HEAP:
+		th->ops = &heap_ops;
+		break;
+	case DSP_TMO_WHEEL:
+		th->ops = &wheel_ops;
+		break;
+	default:
+		msg(LOG_ERR, "invalid timeout store type: 0x%x\n",
+		    flags & DSP_TMO_MASK);
+		free(th);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (flags & DSP_NO_TIMERFD) {
+		struct timespec ts;
+
+		/* timerfd_create() would check the clock source otherwise */
+		if (clock_gettime(source, &ts) == -1) {
+			msg(LOG_ERR, "clock_gettime: %m\n");
+			free(th);
+			return NULL;
+		}
+		th->ev.fd = -1;
+	} else {
+		th->ev.fd = timerfd_create(source, TFD_NONBLOCK|TFD_CLOEXEC);
+		if (th->ev.fd == -1) {
+			msg(LOG_ERR, "timerfd_create: %m\n");
+			free(th);
+			return NULL;
+		}
+		th->ev.ep.events = EPOLLIN;
+	}
+        th->source = th->now_source = source;
+	if (flags & DSP_COARSE_CLOCK) {
+		if (source == CLOCK_MONOTONIC)
+			th->now_source = CLOCK_MONOTONIC_COARSE;
+		else if (source == CLOCK_REALTIME)
+			th->now_source = CLOCK_REALTIME_COARSE;
+	}
+	if (th->ops == &wheel_ops && wheel_init(th) < 0) {
+		free_timeout_handler(th);
+		return NULL;
+	}
+	/*
+	 * Timeouts of a CLOCK_REALTIME timer are stored as wall clock time.
+	 * Setting the disarmed timer with TFD_TIMER_CANCEL_ON_SET makes the
+	 * kernel tell us about clock steps from now on.
+	 */
+	if (source == CLOCK_REALTIME && th->ev.fd != -1) {
+		th->cancel_on_set = true;
+		th->rt_offset = realtime_offset();
+		if (timerfd_settime(th->ev.fd, TFD_TIMER_ABSTIME |
+				    TFD_TIMER_CANCEL_ON_SET, &it, NULL) == -1) {
+			msg(LOG_ERR, "timerfd_settime: %m\n");
+			free_timeout_handler(th);
+			return NULL;
+		}
+	}
 	th->ev.ep.data.ptr = &th->ev;
 	th->ev.callback = timeout_event;
 
@@ -70,35 +232,118 @@ struct event *new_timeout_event(int source)
         return &th->ev;
 }
 
-static long _timeout_rearm(struct timeout_handler *th, long pos)
+struct event *new_timeout_event(int source)
+{
+	return new_timeout_event_ext(source, 0);
+}
+
+static void class_next_expiry(struct timeout_handler *th, struct timespec *ts);
+static void class_reset(struct timeout_handler *th);
+
+static uint64_t ts_to_ns(const struct timespec *ts);
+static const struct timespec null_ts;
+
+static void ns_to_ts(uint64_t ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
+
+/*
+ * Obtain the time the timer must be armed for in @ts, {0, 0} if there
+ * are no timeouts. Return the earliest deadline in ns, before applying
+ * the slack.
+ */
+static uint64_t timeout_next_deadline(struct timeout_handler *th,
+				      struct timespec *ts)
+{
+	uint64_t raw;
+
+	*ts = null_ts;
+	th->ops->next_expiry(th, ts);
+	class_next_expiry(th, ts);
+
+	raw = ts_to_ns(ts);
+	if (th->slack_ns > 0 && raw > 0 && raw <= UINT64_MAX - th->slack_ns) {
+		/*
+		 * Round up to a multiple of the slack. Timeouts expiring
+		 * in the same slack interval will be handled in one wakeup.
+		 */
+		ns_to_ts((raw + th->slack_ns - 1) / th->slack_ns *
+			 th->slack_ns, ts);
+	}
+	return raw;
+}
+
+/*
+ * Arm the timerfd for the earliest timeout.
+ *
+ * Unless @force is set, the timer is only re-armed if the earliest timeout
+ * is earlier than the time the timer is currently armed for. If it's later,
+ * or if there are no timeouts any more, we accept a spurious wakeup, which
+ * is usually cheaper than the system call. timeout_event() re-arms the timer
+ * once after running all expired timeouts.
+ */
+static int _timeout_rearm(struct timeout_handler *th, bool force)
 {
         struct itimerspec it = { .it_interval = { 0, 0 }, };
+	uint64_t raw;
         int rc;
 
-        if (pos < (long)th->len)
-                it.it_value = *th->timeouts[pos];
+	/* DSP_NO_TIMERFD: event_wait() calls timeout_get_next() */
+	if (th->ev.fd == -1)
+		return 0;
 
-	if (ts_compare(&it.it_value, &th->expiry) == 0)
-		return pos;
+	/* Deferred, not avoided: the timer is re-armed at the end */
+	if ((th->in_expiry || th->batching) && !force)
+		return 0;
+
+	raw = timeout_next_deadline(th, &it.it_value);
+
+	if (ts_compare(&it.it_value, &th->expiry) == 0) {
+		th->armed_ns = raw;
+		th->stats.settime_avoided++;
+		return 0;
+	}
+
+	if (!force && ts_compare(&th->expiry, &null_ts) != 0 &&
+	    (ts_compare(&it.it_value, &null_ts) == 0 ||
+	     ts_compare(&it.it_value, &th->expiry) > 0)) {
+		th->stats.settime_avoided++;
+		return 0;
+	}
 
-        msg(LOG_DEBUG, "current: %ld/%zd, expire: %ld.%06ld\n",
-            pos, th->len, (long)it.it_value.tv_sec, it.it_value.tv_nsec / 1000L);
+        msg(LOG_DEBUG, "current: %zd, expire: %ld.%06ld\n",
+            th->len, (long)it.it_value.tv_sec, it.it_value.tv_nsec / 1000L);
+	TRACE3(timer_rearm, th->ev.fd, it.it_value.tv_sec, it.it_value.tv_nsec);
 
-        rc = timerfd_settime(th->ev.fd, TFD_TIMER_ABSTIME, &it, NULL);
+	th->stats.settime_calls++;
+        rc = timerfd_settime(th->ev.fd, TFD_TIMER_ABSTIME |
+			     (th->cancel_on_set ? TFD_TIMER_CANCEL_ON_SET : 0),
+			     &it, NULL);
+	if (rc == -1 && errno == ECANCELED) {
+		/*
+		 * The clock was set, and the kernel reports it here rather
+		 * than in read(). Adjust the timeouts and try again.
+		 */
+		timeout_clock_set(th);
+		raw = timeout_next_deadline(th, &it.it_value);
+		rc = timerfd_settime(th->ev.fd, TFD_TIMER_ABSTIME |
+				     TFD_TIMER_CANCEL_ON_SET, &it, NULL);
+	}
         if (rc == -1) {
                 msg(LOG_ERR, "timerfd_settime: %m\n");
                 return -errno;
         } else {
 		th->expiry = it.it_value;
-                return pos;
+		th->armed_ns = raw;
+                return 0;
 	}
 }
 
-static const struct timespec null_ts;
-
 static long timeout_resize(struct timeout_handler *th, size_t size)
 {
-	struct timespec **tmp;
+	struct tmo_entry *tmp;
 
 	if (size > LONG_MAX)
 		return -EOVERFLOW;
@@ -106,272 +351,1736 @@ static long timeout_resize(struct timeout_handler *th, size_t size)
 	if (size == 0) {
 		free(th->timeouts);
 		th->timeouts = NULL;
-		th->len = 0;
+		th->first = th->len = th->size = 0;
 		return 0;
 	}
 
-	msg(LOG_DEBUG, "size old %zu new %zu\n", th->len, size);
+	msg(LOG_DEBUG, "size old %zu new %zu\n", th->size, size);
 	tmp = realloc(th->timeouts, size * sizeof(*th->timeouts));
 	if (tmp == NULL)
 		return -errno;
 
 	th->timeouts = tmp;
+	th->size = size;
 	return size;
 }
 
+/* Make room for at least @len elements, growing geometrically */
+static long timeout_reserve(struct timeout_handler *th, size_t len)
+{
+	size_t size;
+
+	if (len <= th->size)
+		return th->size;
+	size = th->size ? 2 * th->size : 8;
+	if (size < len)
+		size = len;
+	return timeout_resize(th, size);
+}
+
 int timeout_reset(struct event  *tmo_event)
 {
 	struct timeout_handler *th =
 		container_of(tmo_event, struct timeout_handler, ev);
 
-	timeout_resize(th, 0);
-	return _timeout_rearm(th, 0);
+	th->ops->reset(th);
+	class_reset(th);
+	/* cleanup_dispatcher() promises to disarm the timer */
+	return _timeout_rearm(th, true);
 }
 
-static int absolute_timespec(int source, struct timespec *ts)
+/*
+ * The current time, cached during dispatch. Relative timeouts are based
+ * on it, thus it's read from @source: a coarse clock lags behind the
+ * timer by an unknown amount (more than its resolution on NOHZ kernels),
+ * and timeouts based on it could expire early.
+ */
+static int timeout_now_ts(const struct timeout_handler *th,
+			  struct timespec *now)
 {
-	struct timespec now;
-
-	if (clock_gettime(source, &now) == -1)
+	if (th->now_valid)
+		*now = th->now;
+	else if (clock_gettime(th->source, now) == -1)
 		return -errno;
-	ts->tv_sec += now.tv_sec;
-	ts->tv_nsec += now.tv_nsec;
 	return 0;
 }
 
-static int timeout_add_ev(struct timeout_handler *th, struct event *event)
+/* Read the clock into the cache */
+static void timeout_refresh_now(struct timeout_handler *th)
+{
+	clock_gettime(th->source, &th->now);
+}
+
+static int absolute_timespec(const struct timeout_handler *th,
+			     struct timespec *ts)
 {
-        long pos;
+	struct timespec now;
 	int rc;
 
-        if (!th || !event)
-                return -EINVAL;
+	if ((rc = timeout_now_ts(th, &now)) < 0)
+		return rc;
+	ts->tv_sec += now.tv_sec;
+	ts->tv_nsec += now.tv_nsec;
+	return 0;
+}
 
-	if (ts_compare(&event->tmo, &null_ts) == 0)
+/* Convert a normalized timespec to a key, saturating for huge values */
+static uint64_t ts_to_ns(const struct timespec *ts)
+{
+	if (ts->tv_sec < 0)
 		return 0;
+	if ((uint64_t)ts->tv_sec >= UINT64_MAX / 1000000000ULL)
+		return UINT64_MAX;
+	return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+/* CLOCK_REALTIME - CLOCK_MONOTONIC in ns */
+static int64_t realtime_offset(void)
+{
+	struct timespec rt, mono;
 
-	for (pos = 0; pos < (long)th->len; pos++)
-		if (th->timeouts[pos] == &event->tmo) {
-			msg(LOG_DEBUG, "event %p exists already at pos %ld/%zu\n",
-			    event, pos, th->len);
-			return -EEXIST;
-		};
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &rt);
+	return ((int64_t)rt.tv_sec - mono.tv_sec) * 1000000000LL +
+		rt.tv_nsec - mono.tv_nsec;
+}
 
-	if ((rc = timeout_resize(th, th->len + 1)) < 0) {
-		msg(LOG_ERR, "failed to increase array size: %m\n");
-		return rc;
+/* Add @delta ns to @ts. Deadlines before the epoch expire immediately. */
+static void ts_shift(struct timespec *ts, int64_t delta)
+{
+	ts->tv_sec += delta / 1000000000LL;
+	ts->tv_nsec += delta % 1000000000LL;
+	ts_normalize(ts);
+	if (ts->tv_sec < 0 || ts_compare(ts, &null_ts) == 0) {
+		ts->tv_sec = 0;
+		ts->tv_nsec = 1;
 	}
+}
 
-        if (~event->flags & TMO_ABS &&
-	    absolute_timespec(th->source, &event->tmo) == -1)
-			return -errno;
-
-        pos = ts_insert(th->timeouts, &th->len, th->len + 1, &event->tmo);
-        if (pos < 0) {
-                msg(LOG_ERR, "ts_insert failed: %m\n");
-                return errno ? -errno : -EIO;
-        }
+/*
+ * Shift the timeout of @evt by @delta ns, unless it's absolute (TMO_ABS).
+ * Return true if it was shifted.
+ */
+static bool shift_event(struct event *evt, int64_t delta)
+{
+	if (evt->flags & TMO_ABS)
+		return false;
+	ts_shift(&evt->tmo, delta);
+	if (evt->flags & __EV_TMO_DEFER)
+		ts_shift(&evt->__tmo_due, delta);
+	return true;
+}
 
-        msg(LOG_DEBUG, "new timeout at pos %ld/%zd: %ld.%06ld\n",
-            pos, th->len, (long)event->tmo.tv_sec, event->tmo.tv_nsec / 1000L);
+/* Minimal circular doubly linked lists, through evt->__tmo_link */
+static void link_init(struct __tmo_link *head)
+{
+	head->next = head->prev = head;
+}
 
-        if (pos == 0)
-                _timeout_rearm(th, pos);
+static bool link_empty(const struct __tmo_link *head)
+{
+	return head->next == head;
+}
 
-        return 0;
+static void link_add_tail(struct __tmo_link *head, struct __tmo_link *l)
+{
+	l->prev = head->prev;
+	l->next = head;
+	head->prev->next = l;
+	head->prev = l;
 }
 
-int timeout_add(struct event *tmo_event, struct event *ev)
+static void link_del(struct __tmo_link *l)
 {
-	return timeout_add_ev(container_of(tmo_event, struct timeout_handler, ev), ev);
+	l->prev->next = l->next;
+	l->next->prev = l->prev;
+	l->next = l->prev = NULL;
 }
 
-static int timeout_cancel_ev(struct timeout_handler *th, struct event *evt)
+/* Move all elements of @from to the empty list @to */
+static void link_splice(struct __tmo_link *from, struct __tmo_link *to)
 {
-        struct timespec *ts = &evt->tmo;
-        long pos;
+	if (link_empty(from)) {
+		link_init(to);
+		return;
+	}
+	to->next = from->next;
+	to->prev = from->prev;
+	to->next->prev = to;
+	to->prev->next = to;
+	link_init(from);
+}
 
-	if (ts_compare(&evt->tmo, &null_ts) == 0)
-		return 0;
+/* Append all elements of @from to @to */
+static void link_splice_tail(struct __tmo_link *from, struct __tmo_link *to)
+{
+	if (link_empty(from))
+		return;
+	from->next->prev = to->prev;
+	to->prev->next = from->next;
+	from->prev->next = to;
+	to->prev = from->prev;
+	link_init(from);
+}
 
-        for (pos = 0; pos < (long)th->len && ts != th->timeouts[pos]; pos++);
+static struct event *link_to_event(struct __tmo_link *l)
+{
+	return container_of(l, struct event, __tmo_link);
+}
 
-        if (pos == (long)th->len) {
-                msg(LOG_DEBUG, "%p: not found\n", evt);
-		/*
-		 * This is normal if called from a timeout handler.
-		 * Mark the event as having no timeout.
-		 */
-		*ts = null_ts;
-                return -ENOENT;
-        }
+/*
+ * Sorted array. Insertion and repositioning need a memmove(),
+ * expired timeouts are removed from the start of the array in one go.
+ */
 
-	msg(LOG_DEBUG, "timeout %ld cancelled, %ld.%06ld\n",
-            pos, (long)ts->tv_sec, ts->tv_nsec / 1000L);
+static KEY_SEARCH(key_search, struct tmo_entry, .key)
 
-	*ts = null_ts;
-        memmove(&th->timeouts[pos], &th->timeouts[pos + 1],
-                (th->len - pos - 1) * sizeof(*th->timeouts));
+static long sorted_find(const struct timeout_handler *th,
+			const struct event *evt)
+{
+	const struct tmo_entry *tmo = th->timeouts + th->first;
+	uint64_t key = ts_to_ns(&evt->tmo);
+	long pos;
 
-        th->len--;
-        if (pos == 0)
-                _timeout_rearm(th, 0);
-        return 0;
+	/* There could be several timeouts with the same expiry, find the right one */
+	for (pos = key_search(tmo, th->len, key);
+	     pos < (long)th->len && tmo[pos].key == key;
+	     pos++) {
+		if (tmo[pos].evt == evt)
+			return pos;
+	}
+	return -ENOENT;
 }
 
-int timeout_cancel(struct event *tmo_event, struct event *ev)
+/*
+ * There may be free space both before and after the elements of the
+ * array. Make room at @pos by moving the shorter part of the array if
+ * possible. If there's no space at the side where it's needed, grow the
+ * array, or move the elements to the center if there's lots of free space
+ * at the front (left over by expired timeouts).
+ */
+static long sorted_make_room(struct timeout_handler *th, long pos)
 {
-	return timeout_cancel_ev(container_of(tmo_event, struct timeout_handler, ev), ev);
+	struct tmo_entry *tmo;
+	size_t first;
+	long rc;
+
+	if (th->first + th->len == th->size &&
+	    (th->first == 0 || pos > (long)th->len / 2)) {
+		if (th->first <= th->size / 4 &&
+		    (rc = timeout_reserve(th, th->size + 1)) < 0) {
+			msg(LOG_ERR, "failed to increase array size: %m\n");
+			return rc;
+		}
+		first = (th->size - th->len) / 2;
+		memmove(th->timeouts + first, th->timeouts + th->first,
+			th->len * sizeof(*th->timeouts));
+		th->first = first;
+	}
+
+	tmo = th->timeouts + th->first;
+	if (th->first > 0 && (pos <= (long)th->len / 2 ||
+			      th->first + th->len == th->size)) {
+		memmove(tmo - 1, tmo, pos * sizeof(*tmo));
+		th->first--;
+	} else
+		memmove(&tmo[pos + 1], &tmo[pos], (th->len - pos) * sizeof(*tmo));
+	return 0;
 }
 
-int timeout_modify(struct event *tmo_event, struct event *evt, struct timespec *new)
+/*
+ * While batching, new timeouts are appended unsorted after the end of
+ * the array. sorted_flush() sorts and merges them in one go.
+ */
+static int sorted_stage(struct timeout_handler *th, struct event *evt)
 {
-	struct timeout_handler *th =
-		container_of(tmo_event, struct timeout_handler, ev);
-        struct timespec *ts = &evt->tmo;
-        long pos, pnew, pmin;
+	size_t end = th->first + th->len + th->staged;
+	long rc;
 
-	if (ts_compare(&evt->tmo, &null_ts) == 0 || th->len == 0) {
-		evt->tmo = *new;
-		return timeout_add_ev(th, evt);
+	if ((rc = timeout_reserve(th, end + 1)) < 0) {
+		msg(LOG_ERR, "failed to increase array size: %m\n");
+		return rc;
 	}
+	th->timeouts[end].key = ts_to_ns(&evt->tmo);
+	th->timeouts[end].evt = evt;
+	th->staged++;
+	return 0;
+}
 
-	if (ts_compare(new, &null_ts) == 0)
-		return timeout_cancel_ev(th, evt);
+static int sorted_insert(struct timeout_handler *th, struct event *evt)
+{
+	uint64_t key = ts_to_ns(&evt->tmo);
+	struct tmo_entry *tmo;
+	long pos, rc;
+
+	if (th->batching)
+		return sorted_stage(th, evt);
+	pos = key_search(th->timeouts + th->first, th->len, key);
+	if ((rc = sorted_make_room(th, pos)) < 0)
+		return rc;
+	tmo = th->timeouts + th->first;
+	tmo[pos].key = key;
+	tmo[pos].evt = evt;
+	th->len++;
+	return pos == 0;
+}
 
-	if (ts_compare(new, &evt->tmo) == 0)
-		/* Nothing changed */
-		return 0;
+static int sorted_remove(struct timeout_handler *th, struct event *evt)
+{
+	struct tmo_entry *tmo = th->timeouts + th->first;
+	long pos = sorted_find(th, evt);
 
-	/* There could be several timeouts with the same expiry, find the right one */
-	pmin = ts_search(th->timeouts, th->len, ts);
-        for (pos = pmin;
-             pos < (long)th->len &&
-                     ts_compare(th->timeouts[pos], ts) == 0;
-             pos++) {
-                if (ts == th->timeouts[pos])
-                        break;
-        }
+	if (pos < 0)
+		return pos;
+	if (th->batching) {
+		/* Leave a gap, sorted_flush() will close it */
+		tmo[pos].evt = NULL;
+		th->dropped++;
+		return 0;
+	}
+	if (pos < (long)th->len / 2) {
+		memmove(&tmo[1], &tmo[0], pos * sizeof(*tmo));
+		th->first++;
+	} else
+		memmove(&tmo[pos], &tmo[pos + 1],
+			(th->len - pos - 1) * sizeof(*tmo));
+        if (--th->len == 0)
+		th->first = 0;
+	return pos == 0;
+}
 
-        if (pos == (long)th->len || ts != th->timeouts[pos]) {
-		/* This is normal if timeout_modify called from timeout handler */
-                msg(LOG_DEBUG, "%p: not found\n", evt);
-                evt->tmo = *new;
-		return timeout_add_ev(th, evt);
-        }
+static int sorted_move(struct timeout_handler *th, struct event *evt,
+		       struct timespec *new)
+{
+	struct tmo_entry *tmo = th->timeouts + th->first;
+	uint64_t key = ts_to_ns(new);
+	long pos, pnew;
 
-        if (~evt->flags & TMO_ABS && absolute_timespec(th->source, new) == -1)
-		return -errno;
+	if ((pos = sorted_find(th, evt)) < 0)
+		return pos;
 
-	ts_normalize(new);
-	pnew = ts_search(th->timeouts, th->len, new);
-	if (pnew < 0)
-		return pnew;
+	pnew = key_search(tmo, th->len, key);
 
 	if (pnew > pos + 1) {
 		/*
-		 * ts_search returns the position (pnew) at which the new tmo would be
-		 * inserted. All members at pnew or higher are >= new.
+		 * key_search returns the position (pnew) at which the new key would be
+		 * inserted. All members at pnew or higher are >= key.
 		 * So if pnew = pos + 1, nothing needs to be done.
 		 * Subtract 1, because pnew is after pos but pos will be moved away.
 		 */
 		pnew--;
-		memmove(&th->timeouts[pos], &th->timeouts[pos + 1],
-			(pnew - pos)  * sizeof(*th->timeouts));
-		th->timeouts[pnew] = &evt->tmo;
+		memmove(&tmo[pos], &tmo[pos + 1], (pnew - pos)  * sizeof(*tmo));
 	} else if (pnew < pos) {
-		memmove(&th->timeouts[pnew + 1], &th->timeouts[pnew],
-			(pos - pnew)  * sizeof(*th->timeouts));
-		th->timeouts[pnew] = &evt->tmo;
-	}
-	msg(LOG_DEBUG, "timeout %ld now at pos %ld, %ld.%06ld -> %ld.%06ld\n",
-            pos, pnew, (long)ts->tv_sec, ts->tv_nsec / 1000L,
-            (long)new->tv_sec, new->tv_nsec / 1000L);
+		memmove(&tmo[pnew + 1], &tmo[pnew], (pos - pnew)  * sizeof(*tmo));
+	} else
+		pnew = pos;
+	tmo[pnew].key = key;
+	tmo[pnew].evt = evt;
 	evt->tmo = *new;
+	return pos == 0 || pnew == 0;
+}
 
+static bool array_next_expiry(struct timeout_handler *th, struct timespec *ts)
+{
+	if (th->len == 0)
+		return false;
+	*ts = th->timeouts[th->first].evt->tmo;
+	return true;
+}
 
-        if (pnew == 0)
-                _timeout_rearm(th, 0);
-        return 0;
+static void array_reset(struct timeout_handler *th)
+{
+	timeout_resize(th, 0);
+	th->staged = th->dropped = 0;
+}
+
+static size_t timeout_batch_reserve(struct timeout_handler *th, size_t n);
+
+static int entry_compare(const void *p1, const void *p2)
+{
+	const struct tmo_entry *e1 = p1, *e2 = p2;
+
+	return e1->key < e2->key ? -1 : e1->key > e2->key;
+}
+
+static KEY_RADIX_SORT(entry_radix_sort, struct tmo_entry, .key)
+
+/*
+ * End of a batch: close the gaps left by removed timeouts, sort the staged
+ * ones, and merge them into the array from the end, so that every element
+ * is moved at most once.
+ */
+static void sorted_flush(struct timeout_handler *th)
+{
+	struct tmo_entry *tmo = th->timeouts + th->first, *new;
+	size_t i, j, k, n = th->staged;
+
+	if (th->dropped > 0) {
+		for (i = 0, k = 0; i < th->len + n; i++)
+			if (tmo[i].evt != NULL)
+				tmo[k++] = tmo[i];
+		th->len = k - n;
+	}
+	th->staged = th->dropped = 0;
+
+	if (n == 0)
+		goto out;
+
+	/* While callbacks run, th->batch holds the expired timeouts */
+	if (th->in_expiry || timeout_batch_reserve(th, n) < n) {
+		qsort(tmo, th->len + n, sizeof(*tmo), entry_compare);
+		th->len += n;
+		goto out;
+	}
+
+	new = tmo + th->len;
+	if (n >= KEY_RADIX_MIN)
+		new = entry_radix_sort(new, th->batch, n);
+	else
+		qsort(new, n, sizeof(*new), entry_compare);
+	if (new != th->batch) {
+		memcpy(th->batch, new, n * sizeof(*new));
+		new = th->batch;
+	}
+
+	/* Like sorted_insert(), put new timeouts before equal ones */
+	for (i = th->len, j = n, k = th->len + n; j > 0; ) {
+		if (i > 0 && tmo[i - 1].key >= new[j - 1].key)
+			tmo[--k] = tmo[--i];
+		else
+			tmo[--k] = new[--j];
+	}
+	th->len += n;
+out:
+	if (th->len == 0)
+		th->first = 0;
+}
+
+/*
+ * After shifting, the relative and the absolute timeouts are each still
+ * sorted among themselves. Separate them, and merge them again in one pass.
+ */
+static void sorted_shift(struct timeout_handler *th, int64_t delta)
+{
+	struct tmo_entry *tmo = th->timeouts + th->first, *rel;
+	size_t i, k, n_abs = 0, n_rel = 0;
+
+	if (timeout_batch_reserve(th, th->len) < th->len) {
+		/* No memory for the merge, fall back to sorting */
+		for (i = 0; i < th->len; i++)
+			if (shift_event(tmo[i].evt, delta))
+				tmo[i].key = ts_to_ns(&tmo[i].evt->tmo);
+		qsort(tmo, th->len, sizeof(*tmo), entry_compare);
+		return;
+	}
+
+	rel = th->batch;
+	for (i = 0; i < th->len; i++) {
+		if (shift_event(tmo[i].evt, delta)) {
+			rel[n_rel].key = ts_to_ns(&tmo[i].evt->tmo);
+			rel[n_rel++].evt = tmo[i].evt;
+		} else
+			tmo[n_abs++] = tmo[i];
+	}
+
+	/* Merge from the end, the absolute timeouts are at the start */
+	for (k = th->len; n_rel > 0; ) {
+		if (n_abs > 0 && tmo[n_abs - 1].key > rel[n_rel - 1].key)
+			tmo[--k] = tmo[--n_abs];
+		else
+			tmo[--k] = rel[--n_rel];
+	}
+}
+
+/*
+ * Calculate the next deadline of a periodic timer from the expired one,
+ * skipping periods which have passed already. This avoids drift.
+ */
+static uint64_t next_period(struct event *evt, const struct timespec *now)
+{
+	uint64_t tmo = ts_to_ns(&evt->tmo), iv = ts_to_ns(&evt->tmo_interval);
+	uint64_t now_ns = ts_to_ns(now), n = 1;
+
+	evt->tmo_missed = 0;
+	if (iv > UINT64_MAX - tmo)
+		return UINT64_MAX;
+	if (now_ns >= tmo + iv)
+		n = (now_ns - tmo) / iv + 1;
+	evt->tmo_missed = n - 1;
+	return n > (UINT64_MAX - tmo) / iv ? UINT64_MAX : tmo + n * iv;
+}
+
+/*
+ * Called for every expired timeout after it has been removed from the
+ * store. Lazily refreshed timeouts are re-inserted with their real
+ * deadline, unless that has passed, too.
+ */
+static void timeout_expire(struct timeout_handler *th, struct event *evt,
+			   const struct timespec *now)
+{
+	uint64_t key, late, next = 0;
+	int rc;
+
+	if (evt->flags & __EV_TMO_DEFER) {
+		evt->flags &= ~__EV_TMO_DEFER;
+		evt->tmo = evt->__tmo_due;
+		if (ts_compare(&evt->tmo, now) > 0) {
+			if ((rc = th->ops->insert(th, evt)) >= 0) {
+				evt->flags |= __EV_TIMEOUT;
+				return;
+			}
+			/* Don't report a timeout that hasn't happened */
+			msg(LOG_ERR, "failed to re-insert lazy timeout: %s\n",
+			    strerror(-rc));
+			evt->tmo = null_ts;
+			return;
+		}
+	}
+
+	/*
+	 * Without slack, every distinct deadline after fired_ns would
+	 * have caused a wakeup of its own.
+	 */
+	if (th->slack_ns > 0) {
+		key = ts_to_ns(&evt->tmo);
+		if (key > th->fired_ns && key != th->last_key) {
+			th->stats.wakeups_saved++;
+			th->last_key = key;
+		}
+	}
+
+	if (!evt->tmo_class && ts_compare(&evt->tmo_interval, &null_ts) > 0) {
+		next = next_period(evt, now);
+		th->stats.missed_ticks += evt->tmo_missed;
+	}
+
+	key = ts_to_ns(&evt->tmo);
+	th->stats.expired++;
+	late = ts_to_ns(now);
+	late = late > key ? late - key : 0;
+	th->stats.total_lateness_ns += late;
+	if (late > th->stats.max_lateness_ns)
+		th->stats.max_lateness_ns = late;
+	if (th->hist)
+		histogram_add(th->hist, late);
+	TRACE2(timer_expire, evt, late);
+
+	_event_invoke_callback(evt, REASON_TIMEOUT, 0, true);
+
+	/*
+	 * Re-arm periodic timers, unless the callback has set a new timeout,
+	 * cancelled it, or removed the event. No rearm necessary, the caller
+	 * does that.
+	 */
+	if (next == 0 ||
+	    evt->flags & (__EV_TIMEOUT | __EV_TMO_CLASS |
+			  __EV_REMOVE | __EV_CLEANUP) ||
+	    evt->tmo_class || ts_compare(&evt->tmo, &null_ts) == 0 ||
+	    ts_compare(&evt->tmo_interval, &null_ts) <= 0)
+		return;
+
+	ns_to_ts(next, &evt->tmo);
+	if (th->ops->insert(th, evt) < 0) {
+		msg(LOG_ERR, "failed to re-arm periodic timer\n");
+		evt->tmo = null_ts;
+		return;
+	}
+	evt->flags |= __EV_TIMEOUT;
 }
 
-static void _timeout_run_callbacks(struct timespec **tss, long n)
+static void _timeout_run_callbacks(struct timeout_handler *th,
+				   const struct tmo_entry *tmo, long n,
+				   const struct timespec *now)
 {
         long i;
 
-        for (i = 0; i < n; i++) {
-                struct event *evt;
+	/* Callbacks may re-add timeouts, clear the flag before calling any */
+        for (i = 0; i < n; i++)
+		tmo[i].evt->flags &= ~__EV_TIMEOUT;
 
-                evt = container_of(tss[i], struct event, tmo);
+        for (i = 0; i < n; i++) {
+                struct event *evt = tmo[i].evt;
 
                 msg(LOG_DEBUG, "calling callback %ld (%ld.%06ld)\n", i,
-                    (long)tss[i]->tv_sec, tss[i]->tv_nsec / 1000);
+                    (long)evt->tmo.tv_sec, evt->tmo.tv_nsec / 1000);
 
-		_event_invoke_callback(evt, REASON_TIMEOUT, 0, true);
+		timeout_expire(th, evt, now);
         }
 
 }
 
-int timeout_event(struct event *tmo_ev, uint32_t events)
+/*
+ * Make room for @n expired timeouts in th->batch. The buffer is kept
+ * for later use, thus memory is only allocated if more timeouts expire
+ * at once than ever before. Failure isn't fatal, the caller processes
+ * as many timeouts as fit.
+ */
+static size_t timeout_batch_reserve(struct timeout_handler *th, size_t n)
 {
-	struct timeout_handler *th = container_of(tmo_ev, struct timeout_handler, ev);
-        struct timespec now;
-        struct timespec **expired;
-        long pos = th->len;
-	uint64_t val;
-
-	if (tmo_ev->reason != REASON_EVENT_OCCURED || events & ~EPOLLIN) {
-		msg(LOG_WARNING, "unexpected reason %s, events 0x%08x\n",
-		    reason_str[tmo_ev->reason], events);
-		return EVENTCB_CONTINUE;
+	struct tmo_entry *tmp;
+	size_t size;
+
+	if (n <= th->batch_size)
+		return n;
+	size = th->batch_size ? 2 * th->batch_size : 8;
+	if (size < n)
+		size = n;
+	tmp = realloc(th->batch, size * sizeof(*th->batch));
+	if (tmp == NULL) {
+		msg(LOG_WARNING, "failed to increase batch size: %m\n");
+		return th->batch_size;
 	}
+	th->batch = tmp;
+	th->batch_size = size;
+	return n;
+}
 
-	if (read(tmo_ev->fd, &val, sizeof(val)) == -1)
-		/*
-		 * EAGAIN happens if the most recent timer was cancelled
-		 * and the timer rearmed before we get here.
-		 */
-		msg(errno == EAGAIN ? LOG_DEBUG : LOG_ERR,
-		    "failed to read timerfd: %m\n");
-
-	clock_gettime(th->source, &now);
+static void sorted_run_expired(struct timeout_handler *th,
+			       const struct timespec *now)
+{
+        struct tmo_entry one, *expired;
+        uint64_t now_key = ts_to_ns(now);
+        long pos, n;
 
         /*
          * callbacks may add new timers, therefore we must iterate here.
 	 * Also, we can't simply run _timeout_run_callbacks(th->timeouts),
-	 * because the array might be changed under us. Therefore allocate
-	 * a new array for the expired timers and iterate over it.
-	 * Note: If the callback forks, this array might never be freed and
-	 * valgrind may report some bytes "still reachable".
+	 * because the array might be changed under us. Therefore the
+	 * expired timers are moved to th->batch first. timeout_event()
+	 * isn't re-entered from callbacks, so th->batch is ours.
          */
         while (th->len > 0) {
 
 		/* Expired timeouts are at the beginning, don't ts_search() here */
-		for (pos = 0;
-		     pos < (long)th->len && ts_compare(th->timeouts[pos], &now) <= 0;
+		struct tmo_entry *tmo = th->timeouts + th->first;
+
+		for (pos = 0; pos < (long)th->len && tmo[pos].key <= now_key;
 		     pos++);
 
-                if (pos == (long)th->len) {
-                        expired = th->timeouts;
-                        th->len = 0;
-                        th->timeouts = NULL;
-                        _timeout_run_callbacks(expired, pos);
-                        free(expired);
-                } else if (pos > 0) {
-                        expired = malloc(pos * sizeof(*expired));
-                        if (expired)
-                                memcpy(expired, th->timeouts, pos * sizeof(*expired));
-                        th->len -= pos;
-                        memmove(th->timeouts, &th->timeouts[pos],
-                                th->len * sizeof(*th->timeouts));
-                        if (expired) {
-                                _timeout_run_callbacks(expired, pos);
-                                free(expired);
-                        }
-                } else
+                if (pos == 0)
                         break;
+
+                if (pos == (long)th->len) {
+			size_t size = th->size;
+
+			/* All expired: swap the buffers instead of copying */
+                        expired = th->timeouts;
+                        th->timeouts = th->batch;
+                        th->size = th->batch_size;
+                        th->batch = expired;
+                        th->batch_size = size;
+                        expired += th->first;
+                        th->first = th->len = 0;
+                        n = pos;
+                } else {
+                        n = timeout_batch_reserve(th, pos);
+                        if (n == 0) {
+                                expired = &one;
+                                n = 1;
+                        } else
+                                expired = th->batch;
+                        memcpy(expired, tmo, n * sizeof(*expired));
+			/* No need to move the rest, just advance the start */
+                        th->len -= n;
+                        th->first = th->len ? th->first + n : 0;
+                }
+                _timeout_run_callbacks(th, expired, n, now);
+        }
+}
+
+static const struct timeout_ops sorted_ops = {
+	.insert = sorted_insert,
+	.remove = sorted_remove,
+	.move = sorted_move,
+	.next_expiry = array_next_expiry,
+	.run_expired = sorted_run_expired,
+	.reset = array_reset,
+	.shift = sorted_shift,
+	.flush = sorted_flush,
+};
+
+/*
+ * 4-ary min-heap. The position of every element is stored in
+ * evt->__tmo_pos, so that it can be found, moved, and removed
+ * in O(log n) time.
+ */
+#define HEAP_D 4
+
+static void heap_set(struct timeout_handler *th, long pos,
+		     const struct tmo_entry *tmo)
+{
+	th->timeouts[pos] = *tmo;
+	tmo->evt->__tmo_pos = pos;
+}
+
+static long heap_sift_up(struct timeout_handler *th, long pos)
+{
+	struct tmo_entry tmo = th->timeouts[pos];
+
+	while (pos > 0) {
+		long parent = (pos - 1) / HEAP_D;
+
+		if (th->timeouts[parent].key <= tmo.key)
+			break;
+		heap_set(th, pos, &th->timeouts[parent]);
+		pos = parent;
+	}
+	heap_set(th, pos, &tmo);
+	return pos;
+}
+
+static long heap_sift_down(struct timeout_handler *th, long pos)
+{
+	struct tmo_entry tmo = th->timeouts[pos];
+	long len = th->len;
+
+	for (;;) {
+		long child = HEAP_D * pos + 1, last, min, i;
+
+		if (child >= len)
+			break;
+		last = child + HEAP_D < len ? child + HEAP_D : len;
+		for (min = child, i = child + 1; i < last; i++)
+			if (th->timeouts[i].key < th->timeouts[min].key)
+				min = i;
+		if (th->timeouts[min].key >= tmo.key)
+			break;
+		heap_set(th, pos, &th->timeouts[min]);
+		pos = min;
+	}
+	heap_set(th, pos, &tmo);
+	return pos;
+}
+
+static long heap_find(const struct timeout_handler *th,
+		      const struct event *evt)
+{
+	long pos = evt->__tmo_pos;
+
+	if (pos >= 0 && pos < (long)th->len && th->timeouts[pos].evt == evt)
+		return pos;
+	return -ENOENT;
+}
+
+static int heap_insert(struct timeout_handler *th, struct event *evt)
+{
+	long rc;
+
+	if ((rc = timeout_reserve(th, th->len + 1)) < 0) {
+		msg(LOG_ERR, "failed to increase array size: %m\n");
+		return rc;
+	}
+	th->timeouts[th->len].key = ts_to_ns(&evt->tmo);
+	th->timeouts[th->len].evt = evt;
+	th->len++;
+	if (th->batching) {
+		/* heap_flush() will restore the heap property */
+		evt->__tmo_pos = th->len - 1;
+		th->staged++;
+		return 0;
+	}
+	return heap_sift_up(th, th->len - 1) == 0;
+}
+
+static void heap_delete(struct timeout_handler *th, long pos)
+{
+	struct tmo_entry last = th->timeouts[--th->len];
+
+	if (pos == (long)th->len)
+		return;
+	heap_set(th, pos, &last);
+	if (heap_sift_up(th, pos) == pos)
+		heap_sift_down(th, pos);
+}
+
+static int heap_remove(struct timeout_handler *th, struct event *evt)
+{
+	long pos = heap_find(th, evt);
+
+	if (pos < 0)
+		return pos;
+	heap_delete(th, pos);
+	if (th->batching && th->staged > 0)
+		/* staged timeouts may have been moved away from the end */
+		th->dropped++;
+	return pos == 0;
+}
+
+static int heap_move(struct timeout_handler *th, struct event *evt,
+		     struct timespec *new)
+{
+	long pos, pnew;
+
+	if ((pos = heap_find(th, evt)) < 0)
+		return pos;
+	evt->tmo = *new;
+	th->timeouts[pos].key = ts_to_ns(new);
+	pnew = heap_sift_up(th, pos);
+	if (pnew == pos)
+		pnew = heap_sift_down(th, pos);
+	return pos == 0 || pnew == 0;
+}
+
+/*
+ * Pop expired timeouts one by one. Callbacks may modify the heap, so
+ * the root must be re-examined after every callback.
+ */
+static void heap_run_expired(struct timeout_handler *th,
+			     const struct timespec *now)
+{
+	uint64_t now_key = ts_to_ns(now);
+
+	while (th->len > 0 && th->timeouts[0].key <= now_key) {
+		struct tmo_entry tmo = th->timeouts[0];
+
+		heap_delete(th, 0);
+		_timeout_run_callbacks(th, &tmo, 1, now);
+	}
+}
+
+/* Restore the heap property bottom-up, in O(n) */
+static void heap_build(struct timeout_handler *th)
+{
+	size_t i;
+
+	if (th->len < 2)
+		return;
+	for (i = (th->len - 2) / HEAP_D + 1; i-- > 0; )
+		heap_sift_down(th, i);
+}
+
+/*
+ * If either all or none of the timeouts were shifted, the heap is still
+ * valid. Otherwise, rebuild it bottom-up in O(n).
+ */
+static void heap_shift(struct timeout_handler *th, int64_t delta)
+{
+	size_t i, n_rel = 0;
+
+	for (i = 0; i < th->len; i++) {
+		if (shift_event(th->timeouts[i].evt, delta)) {
+			th->timeouts[i].key = ts_to_ns(&th->timeouts[i].evt->tmo);
+			n_rel++;
+		}
+	}
+	if (n_rel == 0 || n_rel == th->len)
+		return;
+	heap_build(th);
+}
+
+/*
+ * End of a batch. The staged timeouts are at the end of the heap, sift
+ * them up one by one, unless they make up most of the heap, or timeouts
+ * were removed meanwhile. In that case, rebuild the heap.
+ */
+static void heap_flush(struct timeout_handler *th)
+{
+	size_t i;
+
+	if (th->dropped > 0 || th->staged > th->len / 2)
+		heap_build(th);
+	else
+		for (i = th->len - th->staged; i < th->len; i++)
+			heap_sift_up(th, i);
+	th->staged = th->dropped = 0;
+}
+
+static const struct timeout_ops heap_ops = {
+	.insert = heap_insert,
+	.remove = heap_remove,
+	.move = heap_move,
+	.next_expiry = array_next_expiry,
+	.run_expired = heap_run_expired,
+	.reset = array_reset,
+	.shift = heap_shift,
+	.flush = heap_flush,
+};
+
+/*
+ * Hierarchical timing wheel with a resolution of WHEEL_TICK_NS.
+ *
+ * Level 0 has one slot per tick for the next 256 ticks. Each higher
+ * level covers a 64 times larger range with 64 slots. Timeouts in
+ * higher levels are "cascaded" down to the lower levels when the
+ * wheel reaches their slot. The deadline of every timeout is rounded
+ * up to the next tick, thus timeouts never fire early, but may fire up
+ * to one tick late.
+ *
+ * Slots are doubly linked lists through evt->__tmo_link, so that adding
+ * and cancelling a timeout is O(1). Bitmaps of non-empty slots are used
+ * to find the next expiry quickly.
+ */
+#define WHEEL_TICK_NS 1000000LL
+#define WHEEL_L0_BITS 8
+#define WHEEL_L0_SIZE (1 << WHEEL_L0_BITS)
+#define WHEEL_LN_BITS 6
+#define WHEEL_LN_SIZE (1 << WHEEL_LN_BITS)
+#define WHEEL_LEVELS 5
+#define WHEEL_SHIFT(lvl) (WHEEL_L0_BITS + WHEEL_LN_BITS * ((lvl) - 1))
+#define WHEEL_MAX_DELTA ((1ULL << WHEEL_SHIFT(WHEEL_LEVELS)) - 1)
+
+struct tmo_wheel {
+	/* the next tick to be processed */
+	uint64_t cur;
+	size_t count;
+	uint64_t l0_map[WHEEL_L0_SIZE / 64];
+	uint64_t ln_map[WHEEL_LEVELS - 1];
+	struct __tmo_link l0[WHEEL_L0_SIZE];
+	struct __tmo_link ln[WHEEL_LEVELS - 1][WHEEL_LN_SIZE];
+};
+
+static uint64_t ts_to_tick(const struct timespec *ts, bool round_up)
+{
+	uint64_t ns = ts_to_ns(ts);
+
+	if (round_up && ns <= UINT64_MAX - (WHEEL_TICK_NS - 1))
+		ns += WHEEL_TICK_NS - 1;
+	return ns / WHEEL_TICK_NS;
+}
+
+static uint64_t wheel_now(const struct timeout_handler *th)
+{
+	struct timespec now;
+
+	timeout_now_ts(th, &now);
+	return ts_to_tick(&now, false);
+}
+
+static void wheel_add(struct tmo_wheel *w, struct event *evt)
+{
+	uint64_t tick = ts_to_tick(&evt->tmo, true), delta;
+	unsigned int lvl, idx;
+
+	if (tick < w->cur)
+		tick = w->cur;
+	delta = tick - w->cur;
+
+	if (delta < WHEEL_L0_SIZE) {
+		idx = tick & (WHEEL_L0_SIZE - 1);
+		link_add_tail(&w->l0[idx], &evt->__tmo_link);
+		w->l0_map[idx / 64] |= 1ULL << (idx % 64);
+		return;
+	}
+
+	if (delta > WHEEL_MAX_DELTA)
+		tick = w->cur + WHEEL_MAX_DELTA;
+	for (lvl = 1; lvl < WHEEL_LEVELS - 1; lvl++)
+		if (delta < 1ULL << WHEEL_SHIFT(lvl + 1))
+			break;
+	idx = (tick >> WHEEL_SHIFT(lvl)) & (WHEEL_LN_SIZE - 1);
+	link_add_tail(&w->ln[lvl - 1][idx], &evt->__tmo_link);
+	w->ln_map[lvl - 1] |= 1ULL << idx;
+}
+
+/* Unlink @evt, and clear the bitmap bit if its slot becomes empty */
+static void wheel_del(struct tmo_wheel *w, struct event *evt)
+{
+	struct __tmo_link *prev = evt->__tmo_link.prev;
+	ptrdiff_t idx;
+
+	link_del(&evt->__tmo_link);
+	if (!link_empty(prev))
+		return;
+
+	if (prev >= w->l0 && prev < w->l0 + WHEEL_L0_SIZE) {
+		idx = prev - w->l0;
+		w->l0_map[idx / 64] &= ~(1ULL << (idx % 64));
+	} else if (prev >= &w->ln[0][0] &&
+		   prev < &w->ln[0][0] + (WHEEL_LEVELS - 1) * WHEEL_LN_SIZE) {
+		idx = prev - &w->ln[0][0];
+		w->ln_map[idx / WHEEL_LN_SIZE] &=
+			~(1ULL << (idx % WHEEL_LN_SIZE));
+	}
+}
+
+/* Return the first set bit in @map at or after @start, cyclically */
+static int bitmap_next(uint64_t map, unsigned int start)
+{
+	uint64_t m;
+
+	if (map == 0)
+		return -1;
+	m = map >> start;
+	if (m)
+		return start + __builtin_ctzll(m);
+	return __builtin_ctzll(map);
+}
+
+/*
+ * The earliest tick at which the wheel must be processed: either
+ * a non-empty level 0 slot expires, or a higher level slot must be
+ * cascaded.
+ */
+static bool wheel_next(const struct tmo_wheel *w, uint64_t *next)
+{
+	unsigned int start = w->cur & (WHEEL_L0_SIZE - 1), lvl, i;
+	uint64_t best = UINT64_MAX;
+
+	if (w->count == 0)
+		return false;
+
+	for (i = 0; i <= WHEEL_L0_SIZE / 64; i++) {
+		unsigned int word = (start / 64 + i) % (WHEEL_L0_SIZE / 64);
+		uint64_t map = w->l0_map[word];
+		int bit;
+
+		/* first word: only bits at or after start; last: only before */
+		if (i == 0)
+			map &= ~0ULL << (start % 64);
+		else if (i == WHEEL_L0_SIZE / 64)
+			map &= (1ULL << (start % 64)) - 1;
+		if (map == 0)
+			continue;
+		bit = word * 64 + __builtin_ctzll(map);
+		best = w->cur + ((bit - start) & (WHEEL_L0_SIZE - 1));
+		break;
+	}
+
+	for (lvl = 1; lvl < WHEEL_LEVELS; lvl++) {
+		unsigned int shift = WHEEL_SHIFT(lvl);
+		uint64_t bmin = (w->cur + (1ULL << shift) - 1) >> shift, t;
+		int j = bitmap_next(w->ln_map[lvl - 1],
+				    bmin & (WHEEL_LN_SIZE - 1));
+
+		if (j < 0)
+			continue;
+		t = (bmin + ((j - bmin) & (WHEEL_LN_SIZE - 1))) << shift;
+		if (t < best)
+			best = t;
+	}
+
+	*next = best;
+	return best != UINT64_MAX;
+}
+
+/* Move the timeouts of the current higher level slots down */
+static void wheel_cascade(struct tmo_wheel *w)
+{
+	unsigned int lvl;
+
+	for (lvl = 1; lvl < WHEEL_LEVELS; lvl++) {
+		unsigned int idx = (w->cur >> WHEEL_SHIFT(lvl)) &
+			(WHEEL_LN_SIZE - 1);
+		struct __tmo_link list;
+
+		link_splice(&w->ln[lvl - 1][idx], &list);
+		w->ln_map[lvl - 1] &= ~(1ULL << idx);
+		while (!link_empty(&list)) {
+			struct __tmo_link *l = list.next;
+
+			link_del(l);
+			wheel_add(w, link_to_event(l));
+		}
+		if (idx != 0)
+			break;
+	}
+}
+
+static void wheel_reset(struct timeout_handler *th)
+{
+	struct tmo_wheel *w = th->wheel;
+	unsigned int i, j;
+
+	for (i = 0; i < WHEEL_L0_SIZE; i++)
+		link_init(&w->l0[i]);
+	for (i = 0; i < WHEEL_LEVELS - 1; i++)
+		for (j = 0; j < WHEEL_LN_SIZE; j++)
+			link_init(&w->ln[i][j]);
+	memset(w->l0_map, 0, sizeof(w->l0_map));
+	memset(w->ln_map, 0, sizeof(w->ln_map));
+	w->count = 0;
+	w->cur = wheel_now(th);
+}
+
+static int wheel_init(struct timeout_handler *th)
+{
+	if ((th->wheel = malloc(sizeof(*th->wheel))) == NULL)
+		return -ENOMEM;
+	wheel_reset(th);
+	return 0;
+}
+
+/* Does the timer need to be re-armed for @evt? */
+static int wheel_check_expiry(const struct timeout_handler *th,
+			      const struct event *evt)
+{
+	uint64_t tick = ts_to_tick(&evt->tmo, true);
+
+	if (tick < th->wheel->cur)
+		tick = th->wheel->cur;
+	return ts_compare(&th->expiry, &null_ts) == 0 ||
+		tick < ts_to_tick(&th->expiry, false);
+}
+
+static int wheel_insert(struct timeout_handler *th, struct event *evt)
+{
+	struct tmo_wheel *w = th->wheel;
+
+	if (w->count == 0) {
+		uint64_t now = wheel_now(th);
+
+		if (now > w->cur)
+			w->cur = now;
+	}
+	wheel_add(w, evt);
+	w->count++;
+	return wheel_check_expiry(th, evt);
+}
+
+/*
+ * The timer isn't re-armed when a timeout is removed. This may cause
+ * a spurious wakeup, which is cheaper than finding the next expiry.
+ */
+static int wheel_remove(struct timeout_handler *th, struct event *evt)
+{
+	if (!evt->__tmo_link.next)
+		return -ENOENT;
+	wheel_del(th->wheel, evt);
+	th->wheel->count--;
+	return 0;
+}
+
+static int wheel_move(struct timeout_handler *th, struct event *evt,
+		      struct timespec *new)
+{
+	if (!evt->__tmo_link.next)
+		return -ENOENT;
+	wheel_del(th->wheel, evt);
+	evt->tmo = *new;
+	wheel_add(th->wheel, evt);
+	return wheel_check_expiry(th, evt);
+}
+
+static bool wheel_next_expiry(struct timeout_handler *th, struct timespec *ts)
+{
+	uint64_t tick;
+
+	if (!wheel_next(th->wheel, &tick))
+		return false;
+	ns_to_ts(tick * WHEEL_TICK_NS, ts);
+	return true;
+}
+
+static void wheel_run_expired(struct timeout_handler *th,
+			      const struct timespec *now)
+{
+	struct tmo_wheel *w = th->wheel;
+	uint64_t now_tick = ts_to_tick(now, false);
+
+	while (w->cur <= now_tick) {
+		struct __tmo_link list;
+		uint64_t tick;
+		unsigned int idx;
+
+		if (!wheel_next(w, &tick) || tick > now_tick) {
+			w->cur = now_tick + 1;
+			break;
+		}
+		w->cur = tick;
+		if ((tick & (WHEEL_L0_SIZE - 1)) == 0)
+			wheel_cascade(w);
+
+		idx = tick & (WHEEL_L0_SIZE - 1);
+		link_splice(&w->l0[idx], &list);
+		w->l0_map[idx / 64] &= ~(1ULL << (idx % 64));
+		/* Callbacks may add timeouts, which must not go to this slot */
+		w->cur = tick + 1;
+
+		while (!link_empty(&list)) {
+			struct event *evt = link_to_event(list.next);
+
+			link_del(&evt->__tmo_link);
+			w->count--;
+			evt->flags &= ~__EV_TIMEOUT;
+			msg(LOG_DEBUG, "calling callback (%ld.%06ld)\n",
+			    (long)evt->tmo.tv_sec, evt->tmo.tv_nsec / 1000);
+			timeout_expire(th, evt, now);
+		}
+	}
+}
+
+/*
+ * The slots are relative to the current time, which has jumped.
+ * Collect all timeouts, and add them again for the new current time.
+ */
+static void wheel_shift(struct timeout_handler *th, int64_t delta)
+{
+	struct tmo_wheel *w = th->wheel;
+	struct __tmo_link list;
+	unsigned int i, j;
+
+	link_init(&list);
+	for (i = 0; i < WHEEL_L0_SIZE; i++)
+		link_splice_tail(&w->l0[i], &list);
+	for (i = 0; i < WHEEL_LEVELS - 1; i++)
+		for (j = 0; j < WHEEL_LN_SIZE; j++)
+			link_splice_tail(&w->ln[i][j], &list);
+
+	wheel_reset(th);
+	while (!link_empty(&list)) {
+		struct event *evt = link_to_event(list.next);
+
+		link_del(&evt->__tmo_link);
+		shift_event(evt, delta);
+		wheel_add(w, evt);
+		w->count++;
+	}
+}
+
+static const struct timeout_ops wheel_ops = {
+	.insert = wheel_insert,
+	.remove = wheel_remove,
+	.move = wheel_move,
+	.next_expiry = wheel_next_expiry,
+	.run_expired = wheel_run_expired,
+	.reset = wheel_reset,
+	.shift = wheel_shift,
+};
+
+/*
+ * Timeout classes. Events with a fixed relative timeout are kept in a FIFO
+ * list per class, outside of the timeout store. Adding, refreshing and
+ * cancelling is O(1); only the heads of the lists need to be considered
+ * when the timer is armed.
+ */
+int timeout_add_class(struct event *tmo_event, const struct timespec *duration)
+{
+	struct timeout_handler *th =
+		container_of(tmo_event, struct timeout_handler, ev);
+	struct tmo_class **tmp, *cls;
+	struct timespec dur;
+	unsigned int i;
+
+	if (!duration)
+		return -EINVAL;
+	dur = *duration;
+	ts_normalize(&dur);
+	if (dur.tv_sec < 0 || ts_compare(&dur, &null_ts) == 0)
+		return -EINVAL;
+
+	for (i = 0; i < th->n_classes; i++)
+		if (ts_compare(&th->classes[i]->duration, &dur) == 0)
+			return i + 1;
+
+	if (th->n_classes >= INT_MAX)
+		return -EOVERFLOW;
+	tmp = realloc(th->classes, (th->n_classes + 1) * sizeof(*th->classes));
+	if (!tmp)
+		return -ENOMEM;
+	th->classes = tmp;
+	if ((cls = malloc(sizeof(*cls))) == NULL)
+		return -ENOMEM;
+	cls->duration = dur;
+	link_init(&cls->head);
+	th->classes[th->n_classes++] = cls;
+
+	msg(LOG_DEBUG, "new timeout class %u: %ld.%06ld\n", th->n_classes,
+	    (long)dur.tv_sec, dur.tv_nsec / 1000L);
+	return th->n_classes;
+}
+
+static int class_add(struct timeout_handler *th, struct event *evt)
+{
+	struct tmo_class *cls;
+	bool first;
+	int rc;
+
+	if (evt->tmo_class > th->n_classes)
+		return -EINVAL;
+	cls = th->classes[evt->tmo_class - 1];
+
+	evt->tmo = cls->duration;
+	if ((rc = absolute_timespec(th, &evt->tmo)) < 0)
+		return rc;
+	ts_normalize(&evt->tmo);
+
+	first = link_empty(&cls->head);
+	link_add_tail(&cls->head, &evt->__tmo_link);
+	evt->flags |= __EV_TMO_CLASS;
+	th->n_class_events++;
+	TRACE3(timer_add, evt, evt->tmo.tv_sec, evt->tmo.tv_nsec);
+
+	if (first && (ts_compare(&th->expiry, &null_ts) == 0 ||
+		      ts_compare(&evt->tmo, &th->expiry) < 0))
+		_timeout_rearm(th, false);
+	return 0;
+}
+
+/*
+ * Like for the timing wheel, the timer isn't re-armed here, even if
+ * the head of a list is removed.
+ */
+static void class_del(struct timeout_handler *th, struct event *evt)
+{
+	TRACE1(timer_cancel, evt);
+	th->n_class_events--;
+	link_del(&evt->__tmo_link);
+	evt->flags &= ~__EV_TMO_CLASS;
+	evt->tmo = null_ts;
+}
+
+static void class_next_expiry(struct timeout_handler *th, struct timespec *ts)
+{
+	unsigned int i;
+
+	for (i = 0; i < th->n_classes; i++) {
+		struct __tmo_link *head = &th->classes[i]->head;
+		struct event *evt;
+
+		if (link_empty(head))
+			continue;
+		evt = link_to_event(head->next);
+		if (ts_compare(ts, &null_ts) == 0 ||
+		    ts_compare(&evt->tmo, ts) < 0)
+			*ts = evt->tmo;
+	}
+}
+
+static void class_run_expired(struct timeout_handler *th,
+			      const struct timespec *now)
+{
+	unsigned int i;
+
+	for (i = 0; i < th->n_classes; i++) {
+		struct __tmo_link *head = &th->classes[i]->head;
+
+		/* callbacks may re-add the event, it'll be at the tail */
+		while (!link_empty(head)) {
+			struct event *evt = link_to_event(head->next);
+
+			if (ts_compare(&evt->tmo, now) > 0)
+				break;
+			link_del(&evt->__tmo_link);
+			evt->flags &= ~__EV_TMO_CLASS;
+			th->n_class_events--;
+			msg(LOG_DEBUG, "calling callback (%ld.%06ld)\n",
+			    (long)evt->tmo.tv_sec, evt->tmo.tv_nsec / 1000);
+			timeout_expire(th, evt, now);
+		}
+	}
+}
+
+/* Timeouts of classes are always relative, the order doesn't change */
+static void class_shift(struct timeout_handler *th, int64_t delta)
+{
+	unsigned int i;
+
+	for (i = 0; i < th->n_classes; i++) {
+		struct __tmo_link *head = &th->classes[i]->head, *l;
+
+		for (l = head->next; l != head; l = l->next)
+			ts_shift(&link_to_event(l)->tmo, delta);
+	}
+}
+
+static void class_reset(struct timeout_handler *th)
+{
+	unsigned int i;
+
+	for (i = 0; i < th->n_classes; i++)
+		link_init(&th->classes[i]->head);
+	th->n_class_events = 0;
+}
+
+static int timeout_add_ev(struct timeout_handler *th, struct event *event)
+{
+	int rc;
+
+        if (!th || !event)
+                return -EINVAL;
+
+	if (event->flags & (__EV_TIMEOUT | __EV_TMO_CLASS)) {
+		msg(LOG_DEBUG, "event %p exists already\n", event);
+		return -EEXIST;
+	}
+
+	if (event->tmo_class)
+		return class_add(th, event);
+
+	if (ts_compare(&event->tmo, &null_ts) == 0) {
+		/* periodic timers start one interval from now */
+		if (ts_compare(&event->tmo_interval, &null_ts) <= 0)
+			return 0;
+		event->tmo = event->tmo_interval;
+		if ((rc = absolute_timespec(th, &event->tmo)) < 0)
+			return rc;
+	} else if (~event->flags & TMO_ABS &&
+		   (rc = absolute_timespec(th, &event->tmo)) < 0)
+			return rc;
+	ts_normalize(&event->tmo);
+
+        if ((rc = th->ops->insert(th, event)) < 0) {
+                msg(LOG_ERR, "failed to insert timeout: %s\n", strerror(-rc));
+                return rc;
         }
+	event->flags |= __EV_TIMEOUT;
+
+        msg(LOG_DEBUG, "new timeout: %ld.%06ld\n",
+            (long)event->tmo.tv_sec, event->tmo.tv_nsec / 1000L);
+	TRACE3(timer_add, event, event->tmo.tv_sec, event->tmo.tv_nsec);
+
+        if (rc > 0)
+                _timeout_rearm(th, false);
+
+        return 0;
+}
+
+int timeout_add(struct event *tmo_event, struct event *ev)
+{
+	return timeout_add_ev(container_of(tmo_event, struct timeout_handler, ev), ev);
+}
+
+static int timeout_cancel_ev(struct timeout_handler *th, struct event *evt)
+{
+        struct timespec *ts = &evt->tmo;
+	int rc;
+
+	if (evt->flags & __EV_TMO_CLASS) {
+		class_del(th, evt);
+		return 0;
+	}
+
+	if (ts_compare(&evt->tmo, &null_ts) == 0)
+		return 0;
+
+        if (~evt->flags & __EV_TIMEOUT ||
+	    (rc = th->ops->remove(th, evt)) < 0) {
+                msg(LOG_DEBUG, "%p: not found\n", evt);
+		/*
+		 * This is normal if called from a timeout handler.
+		 * Mark the event as having no timeout.
+		 */
+		*ts = null_ts;
+                return -ENOENT;
+        }
+
+	msg(LOG_DEBUG, "timeout cancelled, %ld.%06ld\n",
+            (long)ts->tv_sec, ts->tv_nsec / 1000L);
+	TRACE1(timer_cancel, evt);
+
+	evt->flags &= ~(__EV_TIMEOUT | __EV_TMO_DEFER);
+	*ts = null_ts;
+        if (rc > 0)
+                _timeout_rearm(th, false);
+        return 0;
+}
+
+int timeout_cancel(struct event *tmo_event, struct event *ev)
+{
+	return timeout_cancel_ev(container_of(tmo_event, struct timeout_handler, ev), ev);
+}
+
+int timeout_modify(struct event *tmo_event, struct event *evt, struct timespec *new)
+{
+	struct timeout_handler *th =
+		container_of(tmo_event, struct timeout_handler, ev);
+        struct timespec *ts = &evt->tmo;
+	int rc;
+
+	/* An explicit timeout takes the event out of its timeout class */
+	evt->tmo_class = 0;
+	if (evt->flags & __EV_TMO_CLASS)
+		class_del(th, evt);
+
+	if (ts_compare(&evt->tmo, &null_ts) == 0 || ~evt->flags & __EV_TIMEOUT) {
+		/* This is normal if timeout_modify called from timeout handler */
+		evt->tmo = *new;
+		/* Don't restart a periodic timer which is being cancelled */
+		if (ts_compare(new, &null_ts) == 0)
+			return 0;
+		return timeout_add_ev(th, evt);
+	}
+
+	if (ts_compare(new, &null_ts) == 0)
+		return timeout_cancel_ev(th, evt);
+
+	if (~evt->flags & __EV_TMO_DEFER && ts_compare(new, &evt->tmo) == 0)
+		/* Nothing changed */
+		return 0;
+
+        if (~evt->flags & TMO_ABS &&
+	    (rc = absolute_timespec(th, new)) < 0)
+		return rc;
+
+	ts_normalize(new);
+	TRACE3(timer_modify, evt, new->tv_sec, new->tv_nsec);
+	if (evt->flags & TMO_LAZY && ts_compare(new, &evt->tmo) > 0) {
+		/* timeout_expire() will move the event */
+		evt->__tmo_due = *new;
+		evt->flags |= __EV_TMO_DEFER;
+		return 0;
+	}
+	evt->flags &= ~__EV_TMO_DEFER;
+
+	msg(LOG_DEBUG, "timeout %ld.%06ld -> %ld.%06ld\n",
+            (long)ts->tv_sec, ts->tv_nsec / 1000L,
+            (long)new->tv_sec, new->tv_nsec / 1000L);
+
+	if ((rc = th->ops->move(th, evt, new)) < 0) {
+                msg(LOG_DEBUG, "%p: not found\n", evt);
+                evt->tmo = *new;
+		evt->flags &= ~__EV_TIMEOUT;
+		return timeout_add_ev(th, evt);
+	}
+
+        if (rc > 0)
+                _timeout_rearm(th, false);
+        return 0;
+}
+
+int timeout_modify_class(struct event *tmo_event, struct event *evt,
+			 unsigned int tmo_class)
+{
+	struct timeout_handler *th =
+		container_of(tmo_event, struct timeout_handler, ev);
+
+	if (tmo_class > th->n_classes)
+		return -EINVAL;
+
+	if (evt->flags & __EV_TMO_CLASS)
+		class_del(th, evt);
+	else if (evt->flags & __EV_TIMEOUT)
+		timeout_cancel_ev(th, evt);
 
-        _timeout_rearm(th, 0);
+	evt->tmo_class = tmo_class;
+	evt->tmo = null_ts;
+	return timeout_add_ev(th, evt);
+}
+
+void timeout_batch_begin(struct event *tmo_event, size_t n)
+{
+	struct timeout_handler *th =
+		container_of(tmo_event, struct timeout_handler, ev);
+
+	th->batching = true;
+	/* Failure is not fatal here, insertion would fail later */
+	if (n > 0 && th->ops != &wheel_ops)
+		timeout_reserve(th, th->first + th->len + th->staged + n);
+}
+
+void timeout_batch_end(struct event *tmo_event)
+{
+	struct timeout_handler *th =
+		container_of(tmo_event, struct timeout_handler, ev);
+
+	if (!th->batching)
+		return;
+	th->batching = false;
+	if (th->ops->flush)
+		th->ops->flush(th);
+	_timeout_rearm(th, false);
+}
+
+static void _timeout_run(struct timeout_handler *th, bool expired);
+
+/*
+ * The realtime clock has been set. Relative timeouts must still expire
+ * after the time they were set for, thus move them by the clock step,
+ * in a single pass over every store. Absolute timeouts (TMO_ABS) are left
+ * alone. The step is derived from the offset to CLOCK_MONOTONIC, which
+ * also includes the (small) drift accumulated by slewing since the last
+ * step.
+ */
+static void timeout_clock_set(struct timeout_handler *th)
+{
+	int64_t offset = realtime_offset(), delta = offset - th->rt_offset;
+
+	th->rt_offset = offset;
+	th->stats.clock_steps++;
+	msg(LOG_NOTICE, "realtime clock was set, step: %lld us\n",
+	    (long long)delta / 1000);
+	if (delta == 0)
+		return;
+
+	timeout_refresh_now(th);
+	th->ops->shift(th, delta);
+	class_shift(th, delta);
+}
+
+int timeout_event(struct event *tmo_ev, uint32_t events)
+{
+	struct timeout_handler *th = container_of(tmo_ev, struct timeout_handler, ev);
+	uint64_t val;
+	bool expired, force = false;
+
+	if (tmo_ev->reason != REASON_EVENT_OCCURED || events & ~EPOLLIN) {
+		msg(LOG_WARNING, "unexpected reason %s, events 0x%08x\n",
+		    reason_str[tmo_ev->reason], events);
+		return EVENTCB_CONTINUE;
+	}
+
+	expired = read(tmo_ev->fd, &val, sizeof(val)) != -1;
+	if (!expired && errno == ECANCELED) {
+		timeout_clock_set(th);
+		/* th->expiry is meaningless now */
+		force = true;
+	} else if (!expired)
+		/*
+		 * EAGAIN happens if the most recent timer was cancelled
+		 * and the timer rearmed before we get here.
+		 */
+		msg(errno == EAGAIN ? LOG_DEBUG : LOG_ERR,
+		    "failed to read timerfd: %m\n");
+
+	_timeout_run(th, expired);
+        _timeout_rearm(th, force);
 	return EVENTCB_CONTINUE;
 }
+
+/*
+ * Run the expired timeouts. @expired: the timer has fired, and needn't
+ * be disarmed.
+ */
+static void _timeout_run(struct timeout_handler *th, bool expired)
+{
+	const struct timespec *now = &th->now;
+
+	/*
+	 * During dispatch, use the time read after waking up. Timeouts
+	 * which expire while callbacks are running are handled in the
+	 * next round, the timer will fire immediately for them.
+	 */
+	if (!th->now_valid)
+		timeout_refresh_now(th);
+
+	if (th->slack_ns > 0) {
+		uint64_t now_ns = ts_to_ns(now), exp_ns = ts_to_ns(&th->expiry);
+
+		/*
+		 * Without slack, we'd have woken up at armed_ns with the
+		 * same latency, and processed everything expired until then.
+		 */
+		th->fired_ns = th->armed_ns +
+			(now_ns > exp_ns ? now_ns - exp_ns : 0);
+		th->last_key = 0;
+	}
+	/* The timer has fired and is disarmed now */
+	if (expired)
+		th->expiry = null_ts;
+
+	th->in_expiry = true;
+	th->ops->run_expired(th, now);
+	class_run_expired(th, now);
+	th->in_expiry = false;
+}
+
+void timeout_poll(struct event *tmo_event)
+{
+	struct timeout_handler *th =
+		container_of(tmo_event, struct timeout_handler, ev);
+	struct timespec next, now;
+
+	/*
+	 * Compare with the time cached at wakeup, the clock is only read
+	 * again if there's something to do. Use the deadline rounded for
+	 * slack, like the timer itself would.
+	 */
+	if (timeout_next_deadline(th, &next) == 0 ||
+	    timeout_now_ts(th, &now) < 0 || ts_compare(&now, &next) < 0)
+		return;
+
+	th->stats.polled++;
+	/*
+	 * If the timer has fired, it'll be re-armed below, which resets its
+	 * expiration count. Thus we won't see the timerfd in epoll.
+	 */
+	_timeout_run(th, ts_compare(&th->expiry, &th->now) <= 0);
+	_timeout_rearm(th, false);
+}
+
+bool timeout_get_next(struct event *tmo_event, struct timespec *rel)
+{
+	struct timeout_handler *th =
+		container_of(tmo_event, struct timeout_handler, ev);
+	struct timespec now;
+
+	th->armed_ns = timeout_next_deadline(th, &th->expiry);
+	if (th->armed_ns == 0)
+		return false;
+
+	clock_gettime(th->source, &now);
+	*rel = th->expiry;
+	ts_subtract(rel, &now);
+	if (rel->tv_sec < 0)
+		*rel = null_ts;
+	return true;
+}
+
+void timeout_run(struct event *tmo_event, bool timed_out)
+{
+	_timeout_run(container_of(tmo_event, struct timeout_handler, ev),
+		     timed_out);
+}
+
+void timeout_update_now(struct event *tmo_event)
+{
+	struct timeout_handler *th =
+		container_of(tmo_event, struct timeout_handler, ev);
+
+	timeout_refresh_now(th);
+	th->now_valid = true;
+}
+
+void timeout_clear_now(struct event *tmo_event)
+{
+	container_of(tmo_event, struct timeout_handler, ev)->now_valid = false;
+}
+
+int timeout_now(const struct event *tmo_event, struct timespec *now)
+{
+	const struct timeout_handler *th =
+		container_of_const(tmo_event, struct timeout_handler, ev);
+
+	if (th->now_valid)
+		*now = th->now;
+	else if (clock_gettime(th->now_source, now) == -1)
+		return -errno;
+	return 0;
+}
+
+int timeout_set_slack(struct event *tmo_event, const struct timespec *slack)
+{
+	struct timeout_handler *th =
+		container_of(tmo_event, struct timeout_handler, ev);
+	struct timespec sl;
+
+	if (!slack)
+		return -EINVAL;
+	sl = *slack;
+	ts_normalize(&sl);
+	if (sl.tv_sec < 0)
+		return -EINVAL;
+
+	th->slack_ns = ts_to_ns(&sl);
+	return _timeout_rearm(th, false);
+}
+
+void timeout_get_stats(const struct event *tmo_event,
+		       struct timeout_stats *stats)
+{
+	*stats = container_of_const(tmo_event, struct timeout_handler, ev)->stats;
+}
+
+void timeout_set_histogram(struct event *tmo_event, struct histogram *hist)
+{
+	container_of(tmo_event, struct timeout_handler, ev)->hist = hist;
+}
+
+size_t timeout_get_usage(const struct event *tmo_event, size_t *pending,
+			 size_t *capacity)
+{
+	const struct timeout_handler *th =
+		container_of_const(tmo_event, struct timeout_handler, ev);
+	size_t bytes = sizeof(*th);
+
+	*pending = th->n_class_events;
+	*capacity = th->size;
+	if (th->wheel) {
+		*pending += th->wheel->count;
+		bytes += sizeof(*th->wheel);
+	} else
+		*pending += th->len;
+	bytes += (th->size + th->batch_size) * sizeof(*th->timeouts);
+	bytes += th->n_classes * (sizeof(*th->classes) + sizeof(**th->classes));
+	return bytes;
+}
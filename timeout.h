@@ -6,6 +6,8 @@
 #define _TIMEOUT_H
 
 struct event;
+struct timeout_stats;
+struct histogram;
 
 /**
  * free_timeout_event() - free resources associated with a timeout event
@@ -21,6 +23,17 @@ void free_timeout_event(struct event *tmo_event);
  */
 struct event *new_timeout_event(int source);
 
+/**
+ * new_timeout_event_ext() - create a new timeout event object with options
+ * @source: see new_timeout_event().
+ * @flags: DSP_xxx flags passed to new_dispatcher_ext(). Only the
+ *         DSP_TMO_xxx bits, @DSP_NO_TIMERFD, and @DSP_COARSE_CLOCK
+ *         are used here.
+ *
+ * Return: a new timeout event object on success, NULL on failure.
+ */
+struct event *new_timeout_event_ext(int source, unsigned int flags);
+
 /**
  * timeout_add() - add an event to the timeout list.
  * @tmo_event: struct event returned from new_timeout_event().
@@ -28,6 +41,8 @@ struct event *new_timeout_event(int source);
  *
  * This function adds @event to the list of timeouts handled, using
  * the @event->tmo and @event->flags to determine the expiry of the timeout.
+ * If @event->tmo_class is set, the class duration is used instead, and
+ * @event->tmo is set to the absolute expiry time.
  * When the timeout expires, timeout_event() will call @event->callback()
  * with @event->reason set to @REASON_TIMEOUT.
  * If @event->tmo is {0, 0}, nothing is done.
@@ -49,7 +64,8 @@ int timeout_add(struct event *tmo_event, struct event *event);
  * the new timeout value in @new. If the event isn't currently in the list,
  * timeout_add() will be called. If @new is {0, 0} (no timeout), timeout_cancel()
  * is called. On successful return, @event->tmo will be set
- * to @new, and normalized.
+ * to @new, and normalized. If @event was in a timeout class, it's taken out
+ * of it, and @event->tmo_class is set to 0.
  * IMPORTANT: don't set @event->tmo to @new before calling this function.
  *
  * Return: 0 on success, negative error code on failure. Error codes can be
@@ -57,6 +73,35 @@ int timeout_add(struct event *tmo_event, struct event *event);
  */
 int timeout_modify(struct event *tmo_event, struct event *event, struct timespec *new);
 
+/**
+ * timeout_add_class() - register a timeout class
+ * @tmo_event: struct event returned from new_timeout_event().
+ * @duration: the relative timeout of the class, must be positive.
+ *
+ * See dispatcher_add_tmo_class().
+ *
+ * Return: the class ID (positive) on success, negative error code on failure.
+ *  -EINVAL: @duration is not positive.
+ *  -ENOMEM: failed to allocate memory for the new class.
+ */
+int timeout_add_class(struct event *tmo_event, const struct timespec *duration);
+
+/**
+ * timeout_modify_class() - (re)arm the timeout of an event using a class
+ * @tmo_event: struct event returned from new_timeout_event().
+ * @event: the event to modify
+ * @tmo_class: class ID returned from timeout_add_class(), or 0
+ *
+ * Removes @event from the timeout list or class it's currently in, sets
+ * @event->tmo_class to @tmo_class, and calls timeout_add(). If @tmo_class
+ * is 0, the timeout is cancelled.
+ *
+ * Return: 0 on success, negative error code on failure.
+ *  -EINVAL: @tmo_class doesn't exist.
+ */
+int timeout_modify_class(struct event *tmo_event, struct event *event,
+			 unsigned int tmo_class);
+
 /**
  * timeout_cancel() - remove an event from the timeout list
  * @tmo_event: struct event returned from new_timeout_event().
@@ -72,6 +117,27 @@ int timeout_modify(struct event *tmo_event, struct event *event, struct timespec
  */
 int timeout_cancel(struct event *tmo_event, struct event *);
 
+/**
+ * timeout_batch_begin() - start a batch of timeout additions and removals
+ * @tmo_event: struct event returned from new_timeout_event().
+ * @n: expected number of additions, used to reserve memory. May be 0.
+ *
+ * Until timeout_batch_end() is called, the timer isn't re-armed, and
+ * the sorted array and the heap defer sorting newly added timeouts.
+ * Only timeout_add(), and timeout_cancel() for timeouts added before
+ * the batch started, may be called meanwhile.
+ */
+void timeout_batch_begin(struct event *tmo_event, size_t n);
+
+/**
+ * timeout_batch_end() - complete a batch
+ * @tmo_event: struct event returned from new_timeout_event().
+ *
+ * Sort the timeouts added since timeout_batch_begin() into the store
+ * in one go, and re-arm the timer if necessary.
+ */
+void timeout_batch_end(struct event *tmo_event);
+
 /**
  * timeout_reset() - clear all timeouts
  *
@@ -98,6 +164,111 @@ int timeout_reset(struct event *tmo_event);
  */
 int timeout_event(struct event *tmo_event, uint32_t events);
 
+/**
+ * timeout_get_next() - obtain the time until the next timeout expires
+ * @tmo_event: struct event returned from new_timeout_event_ext() with
+ *             @DSP_NO_TIMERFD.
+ * @rel: buffer for the result, the time from now until the earliest
+ *       timeout expires, {0, 0} if it has expired already.
+ *
+ * Return: false if there are no timeouts, true otherwise.
+ */
+bool timeout_get_next(struct event *tmo_event, struct timespec *rel);
+
+/**
+ * timeout_run() - handle expired timeouts
+ * @tmo_event: struct event returned from new_timeout_event_ext() with
+ *             @DSP_NO_TIMERFD.
+ * @timed_out: true if the wait for the time obtained from timeout_get_next()
+ *             has timed out.
+ *
+ * Like timeout_event(), for timeout events without timerfd. The dispatcher
+ * calls this after waiting for the time obtained from timeout_get_next().
+ */
+void timeout_run(struct event *tmo_event, bool timed_out);
+
+/**
+ * timeout_poll() - handle expired timeouts without waiting for the timer
+ * @tmo_event: struct event returned from new_timeout_event().
+ *
+ * Check if the earliest timeout has expired at the time cached by
+ * timeout_update_now(), taking slack into account, and if yes, run all
+ * expired timeouts. The dispatcher calls this after every round of callbacks in
+ * which the timer event wasn't received, so that timeouts aren't delayed
+ * if the dispatcher is busy with I/O.
+ */
+void timeout_poll(struct event *tmo_event);
+
+/**
+ * timeout_update_now() - read the clock, and cache the result
+ * @tmo_event: struct event returned from new_timeout_event().
+ *
+ * Called by the dispatcher when it's woken up. Until timeout_clear_now()
+ * is called, relative timeouts are based on the cached time, and it's
+ * used to decide which timeouts have expired. The clock is read only once
+ * per wakeup.
+ */
+void timeout_update_now(struct event *tmo_event);
+
+/**
+ * timeout_clear_now() - invalidate the cached time
+ * @tmo_event: struct event returned from new_timeout_event().
+ */
+void timeout_clear_now(struct event *tmo_event);
+
+/**
+ * timeout_now() - obtain the current time
+ * @tmo_event: struct event returned from new_timeout_event().
+ * @now: buffer for the result.
+ *
+ * See dispatcher_now().
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int timeout_now(const struct event *tmo_event, struct timespec *now);
+
+/**
+ * timeout_set_slack() - set the timer slack
+ * @tmo_event: struct event returned from new_timeout_event().
+ * @slack: the new slack, {0, 0} to disable.
+ *
+ * See dispatcher_set_timer_slack().
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int timeout_set_slack(struct event *tmo_event, const struct timespec *slack);
+
+/**
+ * timeout_get_stats() - obtain statistics of the timeout handler
+ * @tmo_event: struct event returned from new_timeout_event().
+ * @stats: buffer for the result.
+ */
+void timeout_get_stats(const struct event *tmo_event,
+		       struct timeout_stats *stats);
+
+/**
+ * timeout_set_histogram() - record the lateness of timeouts
+ * @tmo_event: struct event returned from new_timeout_event().
+ * @hist: the histogram to record into, NULL to stop recording.
+ *
+ * For every expired timeout, the time between its deadline and the time
+ * the handler started processing it is recorded in @hist.
+ */
+void timeout_set_histogram(struct event *tmo_event, struct histogram *hist);
+
+/**
+ * timeout_get_usage() - obtain the size of the timeout store
+ * @tmo_event: struct event returned from new_timeout_event().
+ * @pending: buffer for the number of pending timeouts, including
+ *           those in timeout classes.
+ * @capacity: buffer for the number of timeouts the array of the sorted
+ *            or heap store can hold without growing, 0 for the wheel.
+ *
+ * Return: the number of bytes allocated by the timeout handler.
+ */
+size_t timeout_get_usage(const struct event *tmo_event, size_t *pending,
+			 size_t *capacity);
+
 /**
  * timeout_get_clocksource() - obtain clock source used
  * @tmo_event: struct event returned from new_timeout_event().
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2021 Martin Wilck, SUSE LLC
+ * SPDX-License-Identifier: LGPL-2.1-or-newer
+ */
+#ifndef _TRACE_H
+#define _TRACE_H
+
+/*
+ * USDT static tracepoints of the "minivent" provider, for perf,
+ * bpftrace, or systemtap. Build with "make USDT=1" to enable them; this
+ * requires sys/sdt.h (systemtap-sdt-devel or systemtap-sdt-dev). An
+ * enabled probe costs a nop instruction unless a tracer attaches to it.
+ * Otherwise, the macros compile to nothing, and the arguments aren't
+ * evaluated.
+ *
+ * Probes:
+ *  epoll_return(n_events, batch_size)
+ *  callback_entry(evt, fd, reason)
+ *  callback_return(evt, fd, reason, rc) - don't dereference evt here
+ *  timer_add(evt, tv_sec, tv_nsec)
+ *  timer_modify(evt, tv_sec, tv_nsec)
+ *  timer_cancel(evt)
+ *  timer_expire(evt, lateness_ns)
+ *  timer_rearm(timerfd, tv_sec, tv_nsec)
+ * Timer deadlines are absolute times of the timer's clock.
+ */
+#ifdef USE_USDT
+#include <sys/sdt.h>
+
+#define TRACE1(name, a) DTRACE_PROBE1(minivent, name, a)
+#define TRACE2(name, a, b) DTRACE_PROBE2(minivent, name, a, b)
+#define TRACE3(name, a, b, c) DTRACE_PROBE3(minivent, name, a, b, c)
+#define TRACE4(name, a, b, c, d) DTRACE_PROBE4(minivent, name, a, b, c, d)
+#else
+#define TRACE1(name, a) do { (void)sizeof(a); } while (0)
+#define TRACE2(name, a, b) \
+	do { (void)sizeof(a); (void)sizeof(b); } while (0)
+#define TRACE3(name, a, b, c) \
+	do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); } while (0)
+#define TRACE4(name, a, b, c, d)				\
+	do {							\
+		(void)sizeof(a); (void)sizeof(b);		\
+		(void)sizeof(c); (void)sizeof(d);		\
+	} while (0)
+#endif
+
+#endif
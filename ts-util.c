@@ -99,9 +99,162 @@ long ts_insert(struct timespec **tvs, size_t *len, size_t size,
 	return pos;
 }
 
+uint64_t ts_to_key(const struct timespec *tv)
+{
+	int64_t sec = tv->tv_sec;
+	if (sec > (INT64_MAX - 1000000000L) / 1000000000L)
+		return UINT64_MAX;
+	if (sec < INT64_MIN / 1000000000L)
+		return 0;
+	return (uint64_t) (sec * 1000000000L + tv->tv_nsec) ^ (1ULL << 63);
+}
+
+struct ts_key_ptr {
+	uint64_t key;
+	struct timespec *tv;
+};
+
+static struct ts_key_ptr *ts_radix_sort(struct ts_key_ptr *arr,
+					struct ts_key_ptr *tmp, size_t n)
+{
+	size_t count[8][256];
+	struct ts_key_ptr *swap;
+	unsigned int pass, d;
+	size_t i, pos, c;
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < n; i++)
+		for (pass = 0; pass < 8; pass++)
+			count[pass][(arr[i].key >> (8 * pass)) & 0xff]++;
+	for (pass = 0; pass < 8; pass++) {
+		if (count[pass][(arr[0].key >> (8 * pass)) & 0xff] == n)
+			continue;
+		for (d = 0, pos = 0; d < 256; d++) {
+			c = count[pass][d];
+			count[pass][d] = pos;
+			pos += c;
+		}
+		for (i = 0; i < n; i++) {
+			d = (arr[i].key >> (8 * pass)) & 0xff;
+			tmp[count[pass][d]++] = arr[i];
+		}
+		swap = arr;
+		arr = tmp;
+		tmp = swap;
+	}
+	return arr;
+}
+
+static int ts_sort_radix(struct timespec **tvs, size_t size)
+{
+	struct ts_key_ptr *kp, *res;
+	size_t i;
+	if (size > SIZE_MAX / (2 * sizeof(*kp)))
+		return -ENOMEM;
+	kp = malloc(2 * size * sizeof(*kp));
+	if (!kp)
+		return -ENOMEM;
+	for (i = 0; i < size; i++) {
+		kp[i].key = ts_to_key(tvs[i]);
+		kp[i].tv = tvs[i];
+	}
+	res = ts_radix_sort(kp, kp + size, size);
+	for (i = 0; i < size; i++)
+		tvs[i] = res[i].tv;
+	free(kp);
+	return 0;
+}
+
 void ts_sort(struct timespec **tvs, size_t size)
 {
+	if (size >= 256 && ts_sort_radix(tvs, size) == 0)
+		return;
 	qsort(tvs, size, sizeof(struct timespec *),
 	      (int (*)(const void *, const void *))ts_compare_q);
 	return;
 }
+
+int ts_insert_many(struct timespec **tvs, size_t *len, size_t size,
+		   struct timespec **new, size_t n)
+{
+	size_t i, j, k;
+	if (!tvs || !len || (n > 0 && !new))
+		return -EINVAL;
+	if (size < *len || size - *len < n)
+		return -EOVERFLOW;
+	for (i = 0; i < n; i++) {
+		if (!new[i])
+			return -EINVAL;
+		ts_normalize(new[i]);
+	}
+	ts_sort(new, n);
+	for (i = *len, j = n, k = *len + n; j > 0;) {
+		if (i > 0 && ts_compare(tvs[i - 1], new[j - 1]) >= 0)
+			tvs[--k] = tvs[--i];
+		else
+			tvs[--k] = new[--j];
+	}
+	*len += n;
+	return 0;
+}
+
+static long ts_key_search(const uint64_t * arr, size_t n, uint64_t key)
+{
+	const uint64_t *base = arr;
+	size_t half;
+	if (n == 0)
+		return 0;
+	while (n > 1) {
+		half = n / 2;
+		__builtin_prefetch(&base[half / 2]);
+		__builtin_prefetch(&base[half + half / 2]);
+		base += (base[half - 1] < key) * half;
+		n -= half;
+	}
+	return (base - arr) + (base[0] < key);
+}
+
+long ts_search_keys(const uint64_t * keys, size_t size, struct timespec *new)
+{
+	if (!new || !keys || size > LONG_MAX)
+		return -EINVAL;
+	ts_normalize(new);
+	return ts_key_search(keys, size, ts_to_key(new));
+}
+
+static size_t ts_eytzinger_fill(const uint64_t * keys, size_t len,
+				uint64_t * eyt, long *order, size_t i, size_t k)
+{
+	if (k > len)
+		return i;
+	i = ts_eytzinger_fill(keys, len, eyt, order, i, 2 * k);
+	eyt[k] = keys[i];
+	order[k] = i++;
+	return ts_eytzinger_fill(keys, len, eyt, order, i, 2 * k + 1);
+}
+
+int ts_eytzinger(const uint64_t * keys, size_t len, uint64_t * eyt, long *order)
+{
+	if (!keys || !eyt || !order || len > LONG_MAX - 1)
+		return -EINVAL;
+	eyt[0] = 0;
+	order[0] = len;
+	ts_eytzinger_fill(keys, len, eyt, order, 0, 1);
+	return 0;
+}
+
+long ts_search_eytzinger(const uint64_t * eyt, const long *order, size_t len,
+			 struct timespec *new)
+{
+	uint64_t key;
+	size_t k = 1;
+	if (!new || !eyt || !order || len > LONG_MAX - 1)
+		return -EINVAL;
+	ts_normalize(new);
+	key = ts_to_key(new);
+	while (k <= len) {
+		__builtin_prefetch(&eyt[8 * k]);
+		k = 2 * k + (eyt[k] < key);
+	}
+	k >>= __builtin_ffsl(~k);
+	return order[k];
+}
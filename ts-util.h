@@ -81,8 +81,10 @@ int ts_compare(const struct timespec *t1, const struct timespec *t2);
  *
  * IMPORTANT: all elements of the array should be normalized before calling
  * this function.
- * The array is sorted in ascending order, using ts_compare() for comparing
- * elements.
+ * The array is sorted in ascending order, in the sense of ts_compare().
+ * Large arrays are sorted with a radix sort over the keys of the elements
+ * (see ts_to_key()), which needs temporary memory. If that can't be
+ * allocated, qsort() is used.
  */
 void ts_sort(struct timespec **tss, size_t len);
 
@@ -126,4 +128,87 @@ long ts_search(struct timespec *const *tvs, size_t len, struct timespec *new);
  */
 long ts_insert(struct timespec **tvs, size_t *len, size_t size, struct timespec *new);
 
+/**
+ * ts_insert_many - insert a number of struct timespec into a sorted array
+ *
+ * @tvs: sorted array of normalized "struct timespec *"
+ * @len: number of elements in @tvs
+ * @size: allocated size (in elements) of @tvs
+ * @new: array of new struct timespec objects
+ * @n: number of elements in @new
+ *
+ * Like calling ts_insert() for every element of @new, but much faster for
+ * large @n: @new is sorted with ts_sort(), and merged into @tvs in a single
+ * pass. The elements of @new are normalized, and @new is sorted on
+ * successful return.
+ *
+ * Return: 0 on success.
+ *  -EINVAL if input parameters were invalid.
+ *  -EOVERFLOW if @size is not large enough to add the new elements.
+ */
+int ts_insert_many(struct timespec **tvs, size_t *len, size_t size,
+		   struct timespec **new, size_t n);
+
+/**
+ * ts_to_key() - convert a struct timespec to a 64-bit key
+ *
+ * @ts: normalized timespec object
+ *
+ * Keys compare like the timespec values they were created from, as unsigned
+ * integers. Values which don't fit into 64 bits (as nanoseconds) saturate.
+ *
+ * Return: the key for @ts.
+ */
+uint64_t ts_to_key(const struct timespec *ts);
+
+/**
+ * ts_search_keys - find insertion point for a timespec object in sorted keys
+ *
+ * @keys: sorted array of keys, see ts_to_key()
+ * @len: number of elements in @keys
+ * @new: new struct timespec object
+ *
+ * Like ts_search(), for a packed array of keys. The search doesn't need
+ * to dereference pointers, and it doesn't branch on the comparisons, which
+ * makes it considerably faster than ts_search() for large arrays.
+ * @new is normalized when the function returns successfully.
+ *
+ * Return: see ts_search().
+ */
+long ts_search_keys(const uint64_t *keys, size_t len, struct timespec *new);
+
+/**
+ * ts_eytzinger - arrange sorted keys in Eytzinger layout
+ *
+ * @keys: sorted array of keys, see ts_to_key()
+ * @len: number of elements in @keys
+ * @eyt: array of @len + 1 elements for the result
+ * @order: array of @len + 1 elements, will be filled with the index in @keys
+ *         of every element of @eyt
+ *
+ * The keys are stored in @eyt[1] .. @eyt[@len] in the order of a breadth-first
+ * traversal of the implicit search tree, like a binary heap. This layout
+ * is best suited for repeated searches in large, rarely changing arrays,
+ * see ts_search_eytzinger().
+ *
+ * Return: 0 on success, -EINVAL if input parameters were invalid.
+ */
+int ts_eytzinger(const uint64_t *keys, size_t len, uint64_t *eyt, long *order);
+
+/**
+ * ts_search_eytzinger - find insertion point for a timespec object
+ *
+ * @eyt: keys in Eytzinger layout, see ts_eytzinger()
+ * @order: index array filled by ts_eytzinger()
+ * @len: number of keys
+ * @new: new struct timespec object
+ *
+ * Like ts_search_keys(), for keys in Eytzinger layout.
+ *
+ * Return: the index in the sorted key array from which @eyt was created,
+ * see ts_search(). -EINVAL if input parameters were invalid.
+ */
+long ts_search_eytzinger(const uint64_t *eyt, const long *order, size_t len,
+			 struct timespec *new);
+
 #endif
@@ -32,5 +32,12 @@ int tv_compare(const struct timeval *tv1, const struct timeval *tv2);
 void tv_sort(struct timeval **tvs, size_t len);
 long tv_search(struct timeval *const *tvs, size_t len, struct timeval *new);
 long tv_insert(struct timeval **tvs, size_t *len, size_t size, struct timeval *new);
+int tv_insert_many(struct timeval **tvs, size_t *len, size_t size,
+		   struct timeval **new, size_t n);
+uint64_t tv_to_key(const struct timeval *tv);
+long tv_search_keys(const uint64_t *keys, size_t len, struct timeval *new);
+int tv_eytzinger(const uint64_t *keys, size_t len, uint64_t *eyt, long *order);
+long tv_search_eytzinger(const uint64_t *eyt, const long *order, size_t len,
+			 struct timeval *new);
 
 #endif